@@ -3,7 +3,6 @@
 
 import os
 import sys
-import glob
 import argparse
 import configparser
 import subprocess
@@ -51,41 +50,37 @@ def init_model(config,
 def catstats(prev_iter_id,
              curr_iter_id,
              corpus,
+             count_order,
              max_order=None,
              update_catprobs=False,
              single_parse=False,
              num_threads=1,
              tag=0,
-             max_num_categories=None):
+             max_num_categories=None,
+             smoothing=None):
     catem_dir = config.get("common", "catem_dir")
     catstats_exe = os.path.join(catem_dir, "catstats")
 
-    stats_cmd = "%s %s.arpa.gz %s.cgenprobs.gz %s.cmemprobs.gz %s %s -t %i -g %i" \
+    stats_cmd = "%s %s.arpa.gz %s.cgenprobs.gz %s.cmemprobs.gz %s %s -t %i -g %i -r %i" \
                 % (catstats_exe, prev_iter_id, prev_iter_id, prev_iter_id,
-                   corpus, curr_iter_id, num_threads, tag)
+                   corpus, curr_iter_id, num_threads, tag, count_order)
     if max_order: stats_cmd = "%s -o %i" % (stats_cmd, max_order)
     if update_catprobs: stats_cmd = "%s -u" % stats_cmd
     if single_parse: stats_cmd = "%s -p 1" % stats_cmd
     if max_num_categories: stats_cmd = "%s -c %i" % (stats_cmd, max_num_categories)
+    if smoothing: stats_cmd = "%s -e %s" % (stats_cmd, smoothing)
     subprocess.Popen(stats_cmd, shell=True).wait()
 
-    if num_threads > 1:
-        catseqfnames = glob.glob("%s.thread*.catseq.gz" % curr_iter_id)
-        merge_cmd = "cat %s >%s.catseq.gz" % (" ".join(catseqfnames), curr_iter_id)
-        subprocess.Popen(merge_cmd, shell=True).wait()
-        for catseqfname in catseqfnames:
-            os.remove(catseqfname)
-
 
 def ngram_training(iter_id,
                    smoothing,
                    vocab,
                    order):
     srilm_exe = config.get("common", "srilm")
-    ngram_cmd = "%s -text %s.catseq.gz -unk -vocab %s -order %i -lm %s.arpa.gz" % (
+    ngram_cmd = "%s -read %s.ccounts.gz -unk -vocab %s -order %i -lm %s.arpa.gz" % (
     srilm_exe, iter_id, vocab, order, iter_id)
     if smoothing == "wb":
-        ngram_cmd = "%s %s" % (ngram_cmd, "-wbdiscount -interpolate -text-has-weights -float-counts")
+        ngram_cmd = "%s %s" % (ngram_cmd, "-wbdiscount -interpolate -float-counts")
     elif smoothing == "kn":
         ngram_cmd = "%s %s" % (ngram_cmd, "-kndiscount -interpolate")
     else:
@@ -172,10 +167,13 @@ if __name__ == "__main__":
         print("Tag unks: %i" % tag, file=sys.stderr)
         print("Maximum number of categories: %i" % max_num_categories, file=sys.stderr)
 
+        builtin_estimation = config.get("common", "estimation", fallback="srilm") == "builtin"
         catstats(prev_iter_id, iter_id, args.train_corpus,
-                 max_order, update_catprobs, smoothing == "kn",
-                 args.num_threads, tag, max_num_categories)
-        ngram_training(iter_id, smoothing, vocab, order)
+                 order, max_order, update_catprobs, smoothing == "kn",
+                 args.num_threads, tag, max_num_categories,
+                 smoothing if builtin_estimation else None)
+        if not builtin_estimation:
+            ngram_training(iter_id, smoothing, vocab, order)
 
         if args.eval_corpus:
             print("Computing evaluation corpus perplexity", file=sys.stderr)
@@ -79,12 +79,18 @@ propagate_history(
             }
         }
         else {
+            vector<int> cat_words;
+            for (auto cit = cats->begin(); cit!=cats->end(); ++cit)
+                cat_words.push_back(intmap[cit->first]);
+            vector<int> next_nodes;
             while (init_tokens.size()>0 && tcount++<num_tokens) {
                 HistoryToken tok = init_tokens.top();
                 init_tokens.pop();
-                for (auto cit = cats->begin(); cit!=cats->end(); ++cit) {
+                ngram.advance(tok.m_ngram_node, cat_words, next_nodes);
+                int cidx = 0;
+                for (auto cit = cats->begin(); cit!=cats->end(); ++cit, ++cidx) {
                     HistoryToken ctok = tok;
-                    ctok.m_ngram_node = ngram.advance(ctok.m_ngram_node, intmap[cit->first]);
+                    ctok.m_ngram_node = next_nodes[cidx];
                     ctok.m_ll += cit->second;
                     propagated_tokens.push(ctok);
                 }
@@ -114,7 +120,8 @@ likelihood(
         CategoryHistory& history,
         bool root_unk_states,
         int num_tokens,
-        double beam)
+        double beam,
+        ScoreCache* score_cache)
 {
     bool sentence_end = false;
     bool unk = false;
@@ -144,23 +151,40 @@ likelihood(
         return 0.0;
     }
     else if (sentence_end) {
+        vector<int> nodes;
+        for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit)
+            nodes.push_back(tit->m_ngram_node);
+        vector<double> scores;
+        vector<int> next_nodes;
+        if (score_cache!=nullptr)
+            score_cache->score(nodes, ngram.sentence_end_symbol_idx, scores, next_nodes);
+        else
+            ngram.score(nodes, ngram.sentence_end_symbol_idx, scores, next_nodes);
+
         double total_ll = -FLT_MAX;
-        for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit) {
-            double ll = tit->m_ll;
-            ngram.score(tit->m_ngram_node, ngram.sentence_end_symbol_idx, ll);
-            total_ll = add_log_domain_probs(total_ll, ll);
-        }
+        for (unsigned int i = 0; i<tokens.size(); i++)
+            total_ll = add_log_domain_probs(total_ll, tokens[i].m_ll+scores[i]);
         return total_ll;
     }
     else {
+        vector<int> cat_words;
+        for (auto cit = cmemit->second.begin(); cit!=cmemit->second.end(); ++cit)
+            cat_words.push_back(intmap[cit->first]);
+        vector<double> scores;
+        vector<int> next_nodes;
+
         double total_ll = -FLT_MAX;
-        for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit)
-            for (auto cit = cmemit->second.begin(); cit!=cmemit->second.end(); ++cit) {
-                double ll = tit->m_ll;
-                ngram.score(tit->m_ngram_node, intmap[cit->first], ll);
-                ll += cit->second;
+        for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit) {
+            if (score_cache!=nullptr)
+                score_cache->score(tit->m_ngram_node, cat_words, scores, next_nodes);
+            else
+                ngram.score(tit->m_ngram_node, cat_words, scores, next_nodes);
+            int cidx = 0;
+            for (auto cit = cmemit->second.begin(); cit!=cmemit->second.end(); ++cit, ++cidx) {
+                double ll = tit->m_ll+scores[cidx]+cit->second;
                 total_ll = add_log_domain_probs(total_ll, ll);
             }
+        }
         num_words++;
         history.update(&(cgenit->second));
         return total_ll;
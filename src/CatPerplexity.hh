@@ -49,7 +49,8 @@ double likelihood(
         CategoryHistory& history,
         bool root_unk_states = false,
         int num_tokens = 100,
-        double beam = FLT_MAX);
+        double beam = FLT_MAX,
+        ScoreCache* score_cache = nullptr);
 }
 
 #endif
@@ -3,15 +3,21 @@
 #include <algorithm>
 #include <queue>
 #include <cfloat>
+#include <functional>
 
 #include "Categories.hh"
 
 using namespace std;
 
-bool descending_token_sort(Token* a, Token* b)
-{
-    return (a->m_lp>b->m_lp);
-}
+class DescendingTokenSort {
+public:
+    DescendingTokenSort(const TokenArena& arena) :m_arena(arena) { };
+    bool operator()(int a, int b) const
+    {
+        return (m_arena[a].m_lp>m_arena[b].m_lp);
+    }
+    const TokenArena& m_arena;
+};
 
 Categories::Categories(int num_categories)
 {
@@ -226,6 +232,34 @@ Categories::get_category_gen_probs(std::string word) const
     return &(wit->second);
 }
 
+void
+Categories::freeze()
+{
+    m_word_indices.clear();
+    m_word_offsets.clear();
+    m_entries.clear();
+
+    m_word_offsets.push_back(0);
+    for (auto wit = m_category_mem_probs.begin(); wit!=m_category_mem_probs.end(); ++wit) {
+        const CategoryProbs* cgp = get_category_gen_probs(wit->first);
+        for (auto cit = wit->second.begin(); cit!=wit->second.end(); ++cit) {
+            if (cgp==nullptr || cgp->find(cit->first)==cgp->end())
+                throw string("Category generation probability missing for word: "+wit->first);
+            m_entries.emplace_back(cit->first, cgp->at(cit->first), cit->second);
+        }
+        m_word_indices[wit->first] = m_word_offsets.size()-1;
+        m_word_offsets.push_back(m_entries.size());
+    }
+}
+
+int
+Categories::get_word_index(const string& word) const
+{
+    auto wit = m_word_indices.find(word);
+    if (wit==m_word_indices.end()) return -1;
+    return wit->second;
+}
+
 void
 Categories::get_all_category_mem_probs(vector<map<string, flt_type>>& word_probs) const
 {
@@ -361,48 +395,281 @@ Categories::read_category_mem_probs(string fname)
 }
 
 inline flt_type
-get_cat_gen_lp(Token* tok,
+get_cat_gen_lp(const TokenArena& arena,
+        const Token& tok,
         int context_length)
 {
-    flt_type cat_gen_lp = tok->m_gen_lp;
-    int tmp = 1;
-    while (tok->m_prev_token!=nullptr && tmp++<context_length) {
-        tok = tok->m_prev_token;
-        cat_gen_lp += tok->m_gen_lp;
+    flt_type cat_gen_lp = tok.m_gen_lps[0];
+    int cached_length = min(context_length, Token::GEN_CONTEXT_LENGTH);
+    for (int i = 1; i<cached_length; i++)
+        cat_gen_lp += tok.m_gen_lps[i];
+    if (context_length<=Token::GEN_CONTEXT_LENGTH) return cat_gen_lp;
+
+    // Longer contexts continue from the backpointers
+    int prev_token = tok.m_prev_token;
+    for (int i = 1; i<Token::GEN_CONTEXT_LENGTH && prev_token!=-1; i++)
+        prev_token = arena[prev_token].m_prev_token;
+    for (int i = Token::GEN_CONTEXT_LENGTH; i<context_length && prev_token!=-1; i++) {
+        cat_gen_lp += arena[prev_token].m_gen_lps[0];
+        prev_token = arena[prev_token].m_prev_token;
     }
     return cat_gen_lp;
 }
 
-multimap<flt_type, int>
+// Collects the best tagging hypotheses in descending order to the buffer.
+// Categories are taken from the highest order context node where they occur,
+// the lower order nodes are used until there are enough hypotheses.
+// Returns the number of hypotheses.
+static int
 get_cat_tag_hypotheses(
         const LNNgram& ngram,
-        const vector<int>& indexmap,
+        const vector<int>& categorymap,
         int cng_node,
-        int num_hypotheses = 10)
+        pair<flt_type, int>* hypos,
+        int num_hypotheses)
 {
-    multimap<flt_type, int> cat_tag_hypotheses;
+    static thread_local vector<unsigned int> seen;
+    static thread_local unsigned int seen_stamp = 0;
+    if (seen.size()<categorymap.size()) seen.resize(categorymap.size(), 0);
+    if (++seen_stamp==0) {
+        fill(seen.begin(), seen.end(), 0);
+        seen_stamp = 1;
+    }
 
+    int hypo_count = 0;
     double bo_cost = 0.0;
-    while ((int) cat_tag_hypotheses.size()<num_hypotheses) {
-        int first_arc = ngram.nodes[cng_node].first_arc;
-        int last_arc = ngram.nodes[cng_node].last_arc+1;
+    while (hypo_count<num_hypotheses && cng_node!=-1) {
+        int first_arc, last_arc;
+        ngram.node_arcs(cng_node, first_arc, last_arc);
 
         if (first_arc!=-1) {
-            for (int i = first_arc; i<last_arc; i++) {
-                int target_node = ngram.arc_target_nodes[i];
-                string hypo_cat_str = ngram.vocabulary[ngram.arc_words[i]];
-                if (hypo_cat_str[0]=='<') continue;
-                int hypo_cat_idx = indexmap[str2int(hypo_cat_str)];
-                cat_tag_hypotheses.insert(make_pair(bo_cost+ngram.nodes[target_node].prob,
-                        hypo_cat_idx));
+            for (int i = first_arc; i<=last_arc; i++) {
+                int word = ngram.arc_word(i);
+                int hypo_cat_idx = categorymap[word];
+                if (hypo_cat_idx==-1 || seen[word]==seen_stamp) continue;
+                seen[word] = seen_stamp;
+
+                flt_type score = bo_cost+ngram.node_prob(ngram.arc_target_node(i));
+                if (hypo_count==num_hypotheses && score<=hypos[hypo_count-1].first) continue;
+                int pos = hypo_count<num_hypotheses ? hypo_count++ : hypo_count-1;
+                for (; pos>0 && hypos[pos-1].first<score; pos--)
+                    hypos[pos] = hypos[pos-1];
+                hypos[pos] = make_pair(score, hypo_cat_idx);
             }
         }
 
-        bo_cost += ngram.nodes[cng_node].backoff_prob;
-        cng_node = ngram.nodes[cng_node].backoff_node;
+        bo_cost += ngram.node_backoff_prob(cng_node);
+        cng_node = ngram.node_backoff_node(cng_node);
+    }
+
+    return hypo_count;
+}
+
+// Open addressing table from the recombination state of a token to the token index.
+// The state is the n-gram node and the categories in the category generation context,
+// hashed to 64 bits and compared through the backpointers when the hashes match.
+// Cleared for each position, the entries are reused between positions and sentences.
+class RecombinationTable {
+public:
+    RecombinationTable() :m_mask(0) { };
+    void clear();
+    // Returns the entry of the state, an entry with token index -1 if the state is new
+    pair<int, flt_type>& find(const Token& tok,
+            unsigned long long hash,
+            const TokenArena& arena,
+            int context_length);
+    bool contains(const Token& tok,
+            unsigned long long hash,
+            const TokenArena& arena,
+            int context_length) const;
+
+private:
+    struct Entry {
+        unsigned long long m_hash;
+        pair<int, flt_type> m_state;
+    };
+    void grow();
+    vector<Entry> m_entries;
+    vector<int> m_used;
+    unsigned long long m_mask;
+};
+
+void
+RecombinationTable::clear()
+{
+    for (auto uit = m_used.begin(); uit!=m_used.end(); ++uit)
+        m_entries[*uit].m_state.first = -1;
+    m_used.clear();
+}
+
+void
+RecombinationTable::grow()
+{
+    vector<Entry> old_entries;
+    old_entries.swap(m_entries);
+    m_entries.resize(max((size_t) 256, 2*old_entries.size()));
+    for (auto eit = m_entries.begin(); eit!=m_entries.end(); ++eit)
+        eit->m_state.first = -1;
+    m_mask = m_entries.size()-1;
+    m_used.clear();
+    for (auto eit = old_entries.begin(); eit!=old_entries.end(); ++eit) {
+        if (eit->m_state.first==-1) continue;
+        unsigned long long slot = eit->m_hash & m_mask;
+        while (m_entries[slot].m_state.first!=-1)
+            slot = (slot+1) & m_mask;
+        m_entries[slot] = *eit;
+        m_used.push_back(slot);
+    }
+}
+
+static inline bool
+same_state(const Token& tok,
+        const Token& other_tok,
+        const TokenArena& arena,
+        int context_length)
+{
+    if (tok.m_cng_node!=other_tok.m_cng_node || tok.m_category!=other_tok.m_category)
+        return false;
+    int prev_token = tok.m_prev_token;
+    int other_prev_token = other_tok.m_prev_token;
+    for (int i = 1; i<context_length; i++) {
+        if (prev_token==-1 || other_prev_token==-1) return prev_token==other_prev_token;
+        if (arena[prev_token].m_category!=arena[other_prev_token].m_category) return false;
+        prev_token = arena[prev_token].m_prev_token;
+        other_prev_token = arena[other_prev_token].m_prev_token;
+    }
+    return true;
+}
+
+pair<int, flt_type>&
+RecombinationTable::find(const Token& tok,
+        unsigned long long hash,
+        const TokenArena& arena,
+        int context_length)
+{
+    if (2*(m_used.size()+1)>m_entries.size()) grow();
+    unsigned long long slot = hash & m_mask;
+    while (m_entries[slot].m_state.first!=-1) {
+        if (m_entries[slot].m_hash==hash
+                && same_state(tok, arena[m_entries[slot].m_state.first], arena, context_length))
+            return m_entries[slot].m_state;
+        slot = (slot+1) & m_mask;
+    }
+    m_entries[slot].m_hash = hash;
+    m_used.push_back(slot);
+    return m_entries[slot].m_state;
+}
+
+bool
+RecombinationTable::contains(const Token& tok,
+        unsigned long long hash,
+        const TokenArena& arena,
+        int context_length) const
+{
+    if (m_entries.size()==0) return false;
+    unsigned long long slot = hash & m_mask;
+    while (m_entries[slot].m_state.first!=-1) {
+        if (m_entries[slot].m_hash==hash
+                && same_state(tok, arena[m_entries[slot].m_state.first], arena, context_length))
+            return true;
+        slot = (slot+1) & m_mask;
+    }
+    return false;
+}
+
+static inline unsigned long long
+hash_state(unsigned long long hash, int value)
+{
+    hash ^= (unsigned int) value;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+static unsigned long long
+hash_token_state(const Token& tok,
+        const TokenArena& arena,
+        int context_length)
+{
+    unsigned long long hash = hash_state(hash_state(0, tok.m_cng_node), tok.m_category);
+    int prev_token = tok.m_prev_token;
+    for (int i = 1; i<context_length && prev_token!=-1; i++) {
+        hash = hash_state(hash, arena[prev_token].m_category);
+        prev_token = arena[prev_token].m_prev_token;
+    }
+    return hash;
+}
+
+// Adds a token to the position, merging it with an earlier token with the same
+// n-gram node and the same categories in the category generation context.
+// The merged token keeps the backpointer of the best path. Returns the token index.
+static int
+add_token(const Token& tok,
+        TokenArena& arena,
+        vector<int>& position_tokens,
+        RecombinationTable* states,
+        int context_length)
+{
+    if (states==nullptr) {
+        position_tokens.push_back(arena.add(tok));
+        return position_tokens.back();
+    }
+
+    unsigned long long hash = hash_token_state(tok, arena, context_length);
+    pair<int, flt_type>& state = states->find(tok, hash, arena, context_length);
+    if (state.first==-1) {
+        int tok_idx = arena.add(tok);
+        position_tokens.push_back(tok_idx);
+        state = make_pair(tok_idx, tok.m_lp);
+        return tok_idx;
+    }
+
+    Token& merged_tok = arena[state.first];
+    flt_type merged_lp = add_log_domain_probs(merged_tok.m_lp, tok.m_lp);
+    if (tok.m_lp>state.second) {
+        merged_tok = tok;
+        state.second = tok.m_lp;
     }
+    merged_tok.m_lp = merged_lp;
+    return state.first;
+}
+
+// The best scores of the tokens added to a position are kept in a min-heap.
+// Once the heap is full, tokens not better than its smallest score would be
+// pruned by histogram_prune and are rejected before they are created.
+static inline bool
+below_histogram_threshold(const vector<flt_type>& best_scores,
+        unsigned int num_tokens,
+        flt_type score)
+{
+    return best_scores.size()>=num_tokens && score<=best_scores.front();
+}
+
+static inline void
+update_histogram_threshold(vector<flt_type>& best_scores,
+        unsigned int num_tokens,
+        flt_type score)
+{
+    if (best_scores.size()<num_tokens) {
+        best_scores.push_back(score);
+        push_heap(best_scores.begin(), best_scores.end(), greater<flt_type>());
+        return;
+    }
+    if (score<=best_scores.front()) return;
+    pop_heap(best_scores.begin(), best_scores.end(), greater<flt_type>());
+    best_scores.back() = score;
+    push_heap(best_scores.begin(), best_scores.end(), greater<flt_type>());
+}
 
-    return cat_tag_hypotheses;
+// With recombination only paths creating a new token are rejected,
+// a path merging to an existing token adds to its probability.
+static inline bool
+merges_to_token(const Token& tok,
+        const TokenArena& arena,
+        const RecombinationTable* states,
+        int context_length)
+{
+    if (states==nullptr) return false;
+    return states->contains(tok, hash_token_state(tok, arena, context_length), arena, context_length);
 }
 
 void
@@ -412,122 +679,205 @@ segment_sent(
         const vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        vector<vector<Token*>>& tokens,
-        vector<Token*>& pointers,
+        vector<vector<int>>& tokens,
+        TokenArena& arena,
         unsigned long int* num_vocab_words,
         unsigned long int* num_oov_words,
         unsigned long int* num_unpruned_tokens,
         unsigned long int* num_pruned_tokens)
 {
-    pointers.clear();
-    tokens.clear();
+    if (!categories.frozen()) throw string("Category probabilities are not frozen");
+
+    arena.clear();
+    for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit)
+        tit->clear();
     tokens.resize(words.size()+2);
     bool tag_word = params.tagging!=NO;
     bool tagged = false;
+    int context_length = max(1, (int) params.max_order-1);
+    static thread_local RecombinationTable recombination_states;
+    RecombinationTable* states = params.recombine ? &recombination_states : nullptr;
+    const vector<int>* categorymap = params.categorymap;
+    vector<int> local_categorymap;
 
-    Token* initial_token = new Token();
-    initial_token->m_cng_node = ngram.sentence_start_node;
-    tokens[0].push_back(initial_token);
-    pointers.push_back(initial_token);
+    Token initial_token;
+    initial_token.m_cng_node = ngram.sentence_start_node;
+    tokens[0].push_back(arena.add(initial_token));
 
     for (unsigned int i = 0; i<words.size(); i++) {
 
-        const CategoryProbs* cgp = categories.get_category_gen_probs(words[i]);
-        const CategoryProbs* cmp = categories.get_category_mem_probs(words[i]);
+        int word_idx = categories.get_word_index(words[i]);
+        const CategoryEntry* first_entry = nullptr;
+        const CategoryEntry* last_entry = nullptr;
+        if (word_idx!=-1) {
+            first_entry = categories.entries_begin(word_idx);
+            last_entry = categories.entries_end(word_idx);
+        }
+        bool has_categories = first_entry!=last_entry;
 
-        if (cmp!=nullptr && cmp->size()>0) {
+        if (has_categories) {
             if (num_vocab_words!=nullptr) (*num_vocab_words)++;
         }
         else {
             if (num_oov_words!=nullptr) (*num_oov_words)++;
         }
 
-        vector<Token*>&curr_tokens = tokens[i];
+        vector<int> cat_words;
+        for (const CategoryEntry* eit = first_entry; eit!=last_entry; ++eit)
+            cat_words.push_back(indexmap[eit->m_category]);
+        vector<double> scores;
+        vector<int> next_nodes;
+
+        if (states!=nullptr) states->clear();
+        unsigned int num_tokens = i<words.size()-1 ? params.num_tokens : params.num_final_tokens;
+        static thread_local vector<flt_type> best_scores;
+        best_scores.clear();
+        vector<int>&curr_tokens = tokens[i];
         flt_type best_score = -FLT_MAX;
-        flt_type worst_score = FLT_MAX;
         for (auto tit = curr_tokens.begin(); tit!=curr_tokens.end(); ++tit) {
 
-            Token& tok = *(*tit);
+            // Copied as adding tokens may reallocate the arena
+            const Token tok = arena[*tit];
 
-            flt_type cat_gen_lp = get_cat_gen_lp(&tok, params.max_order-1);
+            flt_type cat_gen_lp = get_cat_gen_lp(arena, tok, params.max_order-1);
 
             // Categories are defined, iterate over memberships
-            if (cmp!=nullptr && cmp->size()>0) {
-                for (auto cit = cmp->cbegin(); cit!=cmp->cend(); ++cit) {
-                    int c = cit->first;
-
-                    flt_type curr_score = tok.m_lp+cat_gen_lp;
-                    int ngram_node_idx = ngram.score(tok.m_cng_node, indexmap[c], curr_score);
-                    curr_score += cit->second;
+            if (has_categories) {
+                if (params.score_cache!=nullptr)
+                    params.score_cache->score(tok.m_cng_node, cat_words, scores, next_nodes);
+                else
+                    ngram.score(tok.m_cng_node, cat_words, scores, next_nodes);
+                int cidx = 0;
+                for (const CategoryEntry* eit = first_entry; eit!=last_entry; ++eit, ++cidx) {
+                    int c = eit->m_category;
+
+                    flt_type curr_score = tok.m_lp+cat_gen_lp+scores[cidx];
+                    int ngram_node_idx = next_nodes[cidx];
+                    curr_score += eit->m_mem_lp;
+
+                    bool reject = (curr_score+params.prob_beam)<best_score
+                        || below_histogram_threshold(best_scores, num_tokens, curr_score);
+                    if (reject && states==nullptr) {
+                        if (num_pruned_tokens!=nullptr) (*num_pruned_tokens)++;
+                        continue;
+                    }
 
-                    if ((curr_score+params.prob_beam)<best_score) {
+                    Token new_tok(tok, *tit, c);
+                    new_tok.m_lp = curr_score;
+                    new_tok.m_gen_lps[0] = eit->m_gen_lp;
+                    new_tok.m_cng_node = ngram_node_idx;
+                    if (reject && !merges_to_token(new_tok, arena, states, context_length)) {
                         if (num_pruned_tokens!=nullptr) (*num_pruned_tokens)++;
                         continue;
                     }
                     if (num_unpruned_tokens!=nullptr) (*num_unpruned_tokens)++;
-                    best_score = max(best_score, curr_score);
-                    worst_score = min(worst_score, curr_score);
-
-                    Token* new_tok = new Token(tok, c);
-                    new_tok->m_lp = curr_score;
-                    new_tok->m_gen_lp = cgp->at(cit->first);
-                    new_tok->m_cng_node = ngram_node_idx;
-                    tokens[i+1].push_back(new_tok);
-                    pointers.push_back(new_tok);
+                    int num_next_tokens = tokens[i+1].size();
+                    int tok_idx = add_token(new_tok, arena, tokens[i+1], states, context_length);
+                    if (params.forward_backward) arena.add_arc(*tit, tok_idx, curr_score-tok.m_lp);
+                    best_score = max(best_score, arena[tok_idx].m_lp);
+                    if ((int) tokens[i+1].size()>num_next_tokens)
+                        update_histogram_threshold(best_scores, num_tokens, curr_score);
                 }
             }
                 // Tag this word
-            else if (cmp!=nullptr && tag_word) {
-                int max_hypos = 10;
-                int hypo_count = 0;
-                multimap<flt_type, int> tag_hypos = get_cat_tag_hypotheses(ngram, indexmap,
-                        tok.m_cng_node, max_hypos);
-                for (auto hit = tag_hypos.rbegin(); hit!=tag_hypos.rend(); ++hit) {
-                    int c = hit->second;
+            else if (word_idx!=-1 && tag_word) {
+                if (categorymap==nullptr) {
+                    local_categorymap = get_class_category_map(indexmap, ngram);
+                    categorymap = &local_categorymap;
+                }
+                const int max_hypos = 10;
+                pair<flt_type, int> tag_hypos[max_hypos];
+                int num_hypos = get_cat_tag_hypotheses(ngram, *categorymap,
+                        tok.m_cng_node, tag_hypos, max_hypos);
+                for (int h = 0; h<num_hypos; h++) {
+                    int c = tag_hypos[h].second;
 
                     flt_type curr_score = tok.m_lp+cat_gen_lp;
                     int ngram_node_idx = ngram.score(tok.m_cng_node, indexmap[c], curr_score);
-
-                    best_score = max(best_score, curr_score);
-                    worst_score = min(worst_score, curr_score);
-
-                    Token* new_tok = new Token(tok, c);
-                    new_tok->m_lp = curr_score;
-                    new_tok->m_cng_node = ngram_node_idx;
-                    tokens[i+1].push_back(new_tok);
-                    pointers.push_back(new_tok);
-
-                    if (++hypo_count>max_hypos) break;
+                    bool reject = below_histogram_threshold(best_scores, num_tokens, curr_score);
+                    if (reject && states==nullptr) continue;
+
+                    Token new_tok(tok, *tit, c);
+                    new_tok.m_lp = curr_score;
+                    new_tok.m_cng_node = ngram_node_idx;
+                    if (reject && !merges_to_token(new_tok, arena, states, context_length)) continue;
+                    int num_next_tokens = tokens[i+1].size();
+                    int tok_idx = add_token(new_tok, arena, tokens[i+1], states, context_length);
+                    if (params.forward_backward) arena.add_arc(*tit, tok_idx, curr_score-tok.m_lp);
+                    best_score = max(best_score, arena[tok_idx].m_lp);
+                    if ((int) tokens[i+1].size()>num_next_tokens)
+                        update_histogram_threshold(best_scores, num_tokens, curr_score);
                 }
                 tagged = true;
             }
                 // Advance with the unk symbol
             else {
-                Token* new_tok = new Token(tok, -1);
-                new_tok->m_lp = tok.m_lp;
-                new_tok->m_cng_node = ngram.advance(tok.m_cng_node, ngram.unk_symbol_idx);
-                tokens[i+1].push_back(new_tok);
-                pointers.push_back(new_tok);
+                Token new_tok(tok, *tit, -1);
+                new_tok.m_cng_node = ngram.advance(tok.m_cng_node, ngram.unk_symbol_idx);
+                int tok_idx = add_token(new_tok, arena, tokens[i+1], states, context_length);
+                if (params.forward_backward) arena.add_arc(*tit, tok_idx, 0.0);
             }
 
         }
 
-        if (i<words.size()-1)
-            histogram_prune(tokens[i+1], params.num_tokens, worst_score, best_score);
-        else
-            histogram_prune(tokens[i+1], params.num_final_tokens, worst_score, best_score);
+        histogram_prune(tokens[i+1], arena, num_tokens);
         if (params.tagging==FIRST && tagged) tag_word = false;
     }
 
     // Add sentence end scores
-    vector<Token*>&curr_tokens = tokens[tokens.size()-2];
-    for (auto tit = curr_tokens.begin(); tit!=curr_tokens.end(); ++tit) {
-        Token& tok = *(*tit);
-        Token* new_tok = new Token(tok, -1);
-        new_tok->m_lp = tok.m_lp+get_cat_gen_lp(&tok, params.max_order-1);
-        new_tok->m_cng_node = ngram.score(tok.m_cng_node, ngram.sentence_end_symbol_idx, new_tok->m_lp);
-        tokens.back().push_back(new_tok);
-        pointers.push_back(new_tok);
+    vector<int>&curr_tokens = tokens[tokens.size()-2];
+    vector<int> nodes;
+    for (auto tit = curr_tokens.begin(); tit!=curr_tokens.end(); ++tit)
+        nodes.push_back(arena[*tit].m_cng_node);
+    vector<double> scores;
+    vector<int> next_nodes;
+    if (params.score_cache!=nullptr)
+        params.score_cache->score(nodes, ngram.sentence_end_symbol_idx, scores, next_nodes);
+    else
+        ngram.score(nodes, ngram.sentence_end_symbol_idx, scores, next_nodes);
+    for (unsigned int t = 0; t<curr_tokens.size(); t++) {
+        const Token tok = arena[curr_tokens[t]];
+        Token new_tok(tok, curr_tokens[t], -1);
+        new_tok.m_lp = tok.m_lp+get_cat_gen_lp(arena, tok, params.max_order-1)+scores[t];
+        new_tok.m_cng_node = next_nodes[t];
+        tokens.back().push_back(arena.add(new_tok));
+        if (params.forward_backward)
+            arena.add_arc(curr_tokens[t], tokens.back().back(), new_tok.m_lp-tok.m_lp);
+    }
+}
+
+// Category posteriors from the forward and backward scores over the surviving tokens.
+// The token scores are the forward scores as only surviving tokens are expanded.
+static void
+accumulate_posteriors(
+        const vector<string>& sent,
+        const vector<int>& word_idxs,
+        const vector<vector<int>>& tokens,
+        const TokenArena& arena,
+        flt_type total_lp,
+        flt_type sent_count,
+        CategoryStats& stats)
+{
+    static thread_local vector<flt_type> backward;
+    backward.assign(arena.size(), -FLT_MAX);
+    for (auto tit = tokens.back().begin(); tit!=tokens.back().end(); ++tit)
+        backward[*tit] = 0.0;
+
+    // Arcs are stored in the order of the positions, so the targets are final when visited
+    for (auto ait = arena.m_arcs.rbegin(); ait!=arena.m_arcs.rend(); ++ait) {
+        if (backward[ait->m_to]==-FLT_MAX) continue;
+        flt_type score = ait->m_score+backward[ait->m_to];
+        if (backward[ait->m_from]==-FLT_MAX) backward[ait->m_from] = score;
+        else backward[ait->m_from] = add_log_domain_probs(backward[ait->m_from], score);
+    }
+
+    for (unsigned int i = 1; i<tokens.size()-1; i++) {
+        for (auto tit = tokens[i].begin(); tit!=tokens[i].end(); ++tit) {
+            const Token& tok = arena[*tit];
+            if (tok.m_category==-1 || backward[*tit]==-FLT_MAX) continue;
+            flt_type lp = std::min((flt_type) 0.0, tok.m_lp+backward[*tit]-total_lp);
+            stats.accumulate(word_idxs[i-1], sent[i-1], tok.m_category, sent_count*exp(lp));
+        }
     }
 }
 
@@ -538,64 +888,78 @@ collect_stats(
         const vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        Categories& stats,
+        CategoryStats& stats,
         SimpleFileOutput* seqf,
+        ClassNgramCounts* counts,
         unsigned long int* num_vocab_words,
         unsigned long int* num_oov_words,
         unsigned long int* num_unpruned_tokens,
-        unsigned long int* num_pruned_tokens)
+        unsigned long int* num_pruned_tokens,
+        unsigned int sent_count)
 {
-    vector<vector<Token*>> tokens;
-    vector<Token*>pointers;
+    static thread_local vector<vector<int>> tokens;
+    static thread_local TokenArena arena;
+    unsigned long int sent_vocab_words = 0;
+    unsigned long int sent_oov_words = 0;
     segment_sent(sent, ngram, indexmap, categories,
             params,
-            tokens, pointers,
-            num_vocab_words, num_oov_words,
+            tokens, arena,
+            &sent_vocab_words, &sent_oov_words,
             num_unpruned_tokens, num_pruned_tokens);
+    if (num_vocab_words!=nullptr) (*num_vocab_words) += sent_count*sent_vocab_words;
+    if (num_oov_words!=nullptr) (*num_oov_words) += sent_count*sent_oov_words;
 
-    vector<Token*>&final_tokens = tokens.back();
+    vector<int>&final_tokens = tokens.back();
 
     if (final_tokens.size()==0) {
         cerr << "No tokens in the final node, skipping sentence" << endl;
-        for (auto pit = pointers.begin(); pit!=pointers.end(); ++pit)
-            delete *pit;
         return 0.0;
     }
 
     flt_type total_lp = MIN_LOG_PROB;
-    for (auto tit = final_tokens.begin(); tit!=final_tokens.end(); ++tit) {
-        Token* tok = *tit;
-        total_lp = add_log_domain_probs(total_lp, tok->m_lp);
-    }
+    for (auto tit = final_tokens.begin(); tit!=final_tokens.end(); ++tit)
+        total_lp = add_log_domain_probs(total_lp, arena[*tit].m_lp);
 
     if (std::isinf(total_lp) || std::isnan(total_lp)) {
         cerr << "Error, invalid total ll" << endl;
-        for (auto pit = pointers.begin(); pit!=pointers.end(); ++pit)
-            delete *pit;
         return 0.0;
     }
 
-    sort(final_tokens.begin(), final_tokens.end(), descending_token_sort);
+    static thread_local vector<int> word_idxs;
+    word_idxs.resize(sent.size());
+    for (unsigned int i = 0; i<sent.size(); i++)
+        word_idxs[i] = categories.get_word_index(sent[i]);
+
+    if (params.forward_backward)
+        accumulate_posteriors(sent, word_idxs, tokens, arena, total_lp, sent_count, stats);
+
+    sort(final_tokens.begin(), final_tokens.end(), DescendingTokenSort(arena));
     for (unsigned int i = 0; i<final_tokens.size(); i++) {
-        Token* tok = final_tokens[i];
+        const Token* tok = &arena[final_tokens[i]];
         flt_type lp = std::min((flt_type) 0.0, tok->m_lp-total_lp);
         vector<int> catseq;
         catseq.push_back(tok->m_category);
-        while (tok->m_prev_token!=nullptr) {
-            tok = tok->m_prev_token;
+        while (tok->m_prev_token!=-1) {
+            tok = &arena[tok->m_prev_token];
             catseq.push_back(tok->m_category);
         }
         std::reverse(catseq.begin(), catseq.end());
 
         flt_type weight = exp(lp);
-        for (unsigned int c = 1; c<catseq.size()-1; c++) {
-            if (catseq[c]==-1) continue; // skip unks
-            stats.accumulate(sent[c-1], catseq[c], weight);
+        if (!params.forward_backward) {
+            for (unsigned int c = 1; c<catseq.size()-1; c++) {
+                if (catseq[c]==-1) continue; // skip unks
+                stats.accumulate(word_idxs[c-1], sent[c-1], catseq[c], sent_count*weight);
+            }
         }
 
+        flt_type parse_weight = sent_count*(params.num_parses>1 ? weight : 1.0);
+        if (counts!=nullptr && i<params.num_parses)
+            counts->accumulate(catseq, parse_weight);
+
         if (seqf!=nullptr) {
             if (i<params.num_parses) {
-                if (params.num_parses>1) *seqf << weight << " ";
+                if (params.num_parses>1 || params.fold_sentences) *seqf << parse_weight << " ";
                 *seqf << SENTENCE_BEGIN_SYMBOL;
                 for (unsigned int c = 1; c<catseq.size()-1; c++) {
                     if (catseq[c]==-1) *seqf << " " << UNK_SYMBOL;
@@ -606,10 +970,118 @@ collect_stats(
         }
     }
 
-    for (auto pit = pointers.begin(); pit!=pointers.end(); ++pit)
-        delete *pit;
+    return sent_count*total_lp;
+}
+
+CategoryStats::CategoryStats(const Categories& categories, int num_shards)
+        :m_categories(categories),
+         m_entry_stats(categories.m_entries.size(), 0.0),
+         m_shard_mutexes(num_shards),
+         m_shard_stats(num_shards)
+{
+    if (!categories.frozen()) throw string("Category probabilities are not frozen");
+}
+
+void
+CategoryStats::accumulate(int word_idx, const string& word, int c, flt_type weight)
+{
+    int shard = word_idx!=-1 ? word_idx%m_shard_stats.size() : 0;
+    lock_guard<mutex> lock(m_shard_mutexes[shard]);
+    if (word_idx!=-1) {
+        const CategoryEntry* first_entry = m_categories.entries_begin(word_idx);
+        const CategoryEntry* last_entry = m_categories.entries_end(word_idx);
+        for (const CategoryEntry* eit = first_entry; eit!=last_entry; ++eit) {
+            if (eit->m_category!=c) continue;
+            m_entry_stats[eit-m_categories.m_entries.data()] += weight;
+            return;
+        }
+    }
+    m_shard_stats[shard][word][c] += weight;
+}
+
+void
+CategoryStats::get_stats(Categories& stats) const
+{
+    for (auto wit = m_categories.m_word_indices.begin(); wit!=m_categories.m_word_indices.end(); ++wit) {
+        const CategoryEntry* first_entry = m_categories.entries_begin(wit->second);
+        const CategoryEntry* last_entry = m_categories.entries_end(wit->second);
+        for (const CategoryEntry* eit = first_entry; eit!=last_entry; ++eit) {
+            double entry_stat = m_entry_stats[eit-m_categories.m_entries.data()];
+            if (entry_stat!=0.0) stats.m_stats[wit->first][eit->m_category] += entry_stat;
+        }
+    }
+    for (auto sit = m_shard_stats.begin(); sit!=m_shard_stats.end(); ++sit)
+        for (auto wit = sit->begin(); wit!=sit->end(); ++wit)
+            for (auto cit = wit->second.begin(); cit!=wit->second.end(); ++cit)
+                stats.m_stats[wit->first][cit->first] += cit->second;
+}
+
+string
+ClassNgramCounts::symbol(int c)
+{
+    if (c==SENTENCE_BEGIN) return SENTENCE_BEGIN_SYMBOL;
+    if (c==SENTENCE_END) return SENTENCE_END_SYMBOL;
+    if (c==-1) return UNK_SYMBOL;
+    return int2str(c);
+}
+
+size_t
+ClassNgramCounts::NgramHash::operator()(const vector<int>& ngram) const
+{
+    size_t h = ngram.size();
+    for (auto nit = ngram.begin(); nit!=ngram.end(); ++nit)
+        h = (h ^ (unsigned int) *nit)*0x100000001B3ULL;
+    return h;
+}
+
+void
+ClassNgramCounts::accumulate(const vector<int>& catseq, double weight)
+{
+    vector<int> seq(catseq);
+    seq.front() = SENTENCE_BEGIN;
+    seq.back() = SENTENCE_END;
+
+    vector<int> ngram;
+    for (unsigned int i = 0; i<seq.size(); i++) {
+        ngram.clear();
+        for (unsigned int j = i; j<seq.size() && (int) (j-i)<m_order; j++) {
+            ngram.push_back(seq[j]);
+            m_counts[ngram] += weight;
+        }
+    }
+}
+
+void
+ClassNgramCounts::accumulate(const ClassNgramCounts& counts)
+{
+    for (auto cit = counts.m_counts.begin(); cit!=counts.m_counts.end(); ++cit)
+        m_counts[cit->first] += cit->second;
+}
 
-    return total_lp;
+void
+ClassNgramCounts::write(string fname) const
+{
+    vector<const pair<const vector<int>, double>*> sorted_counts;
+    sorted_counts.reserve(m_counts.size());
+    for (auto cit = m_counts.begin(); cit!=m_counts.end(); ++cit)
+        sorted_counts.push_back(&(*cit));
+    sort(sorted_counts.begin(), sorted_counts.end(),
+            [](const pair<const vector<int>, double>* a, const pair<const vector<int>, double>* b)
+            { return a->first<b->first; });
+
+    SimpleFileOutput countf(fname);
+    for (auto cit = sorted_counts.begin(); cit!=sorted_counts.end(); ++cit) {
+        const vector<int>& ngram = (*cit)->first;
+        for (unsigned int i = 0; i<ngram.size(); i++) {
+            if (i>0) countf << " ";
+            countf << symbol(ngram[i]);
+        }
+        // Whole counts are written as integers so that they can be read without -float-counts
+        double count = (*cit)->second;
+        if (count==floor(count)) countf << "\t" << (long int) count << "\n";
+        else countf << "\t" << count << "\n";
+    }
+    countf.close();
 }
 
 bool descending_int_flt_sort(
@@ -634,52 +1106,84 @@ void limit_num_categories(
     }
 }
 
-void histogram_prune(
-        vector<Token*>& tokens,
-        int num_tokens,
-        flt_type worst_score,
-        flt_type best_score)
+void
+get_class_unigram_counts(const map<string, int>& word_counts,
+        const Categories& wcl,
+        ClassNgramCounts& counts)
 {
-    if ((int) tokens.size()<=num_tokens) return;
-
-    int NUM_BINS = 100;
-    flt_type range = best_score-worst_score;
-    if (range==0.0) {
-        // Handle some special cases where histogram pruning fails
-        // May happen for instance in the first training iterations
-        if ((int) tokens.size()>(2*num_tokens)) tokens.resize(2*num_tokens);
-        return;
-    }
-
-    vector<int> token_bins(tokens.size());
-    vector<int> bin_counts(NUM_BINS, 0);
-    for (int i = 0; i<(int) tokens.size(); i++) {
-        int bin = round((NUM_BINS-1)*((best_score-tokens[i]->m_lp)/range));
-        token_bins[i] = bin;
-        bin_counts[bin]++;
+    for (auto wit = word_counts.cbegin(); wit!=word_counts.cend(); ++wit) {
+        if (wit->first==SENTENCE_BEGIN_SYMBOL) {
+            counts.m_counts[{ ClassNgramCounts::SENTENCE_BEGIN }] += wit->second;
+            continue;
+        }
+        else if (wit->first==SENTENCE_END_SYMBOL) {
+            counts.m_counts[{ ClassNgramCounts::SENTENCE_END }] += wit->second;
+            continue;
+        }
+        else if (wit->first==UNK_SYMBOL || wit->first==CAP_UNK_SYMBOL) {
+            counts.m_counts[{ -1 }] += wit->second;
+            continue;
+        }
+        if (wcl.m_category_gen_probs.find(wit->first)==wcl.m_category_gen_probs.end())
+            continue;
+        const CategoryProbs& cprobs = wcl.m_category_gen_probs.at(wit->first);
+        if (cprobs.size()==0)
+            counts.m_counts[{ -1 }] += wit->second;
+        else {
+            double tmp = 1.0/(double) cprobs.size();
+            for (auto catit = cprobs.cbegin(); catit!=cprobs.end(); ++catit)
+                counts.m_counts[{ catit->first }] += wit->second*tmp;
+        }
     }
+}
 
-    int bin_limit = 0;
-    int bin_token_count = 0;
-    for (int i = 0; i<NUM_BINS; i++) {
-        bin_token_count += bin_counts[i];
-        bin_limit = i;
-        if (bin_token_count>=num_tokens) break;
+void
+get_expected_category_stats(const map<string, int>& word_counts,
+        const Categories& categories,
+        map<string, CategoryProbs>& stats)
+{
+    for (auto wit = word_counts.cbegin(); wit!=word_counts.cend(); ++wit) {
+        const CategoryProbs* cprobs = categories.get_category_gen_probs(wit->first);
+        if (cprobs==nullptr) continue;
+        for (auto cit = cprobs->cbegin(); cit!=cprobs->cend(); ++cit)
+            stats[wit->first][cit->first] += wit->second*exp(cit->second);
     }
+}
 
-    vector<Token*>pruned_tokens;
-    for (int i = 0; i<(int) tokens.size(); i++)
-        if (token_bins[i]<=bin_limit)
-            pruned_tokens.push_back(tokens[i]);
+void
+interpolate_stats(map<string, CategoryProbs>& running_stats,
+        const map<string, CategoryProbs>& block_stats,
+        double step_size,
+        double scale)
+{
+    for (auto wit = running_stats.begin(); wit!=running_stats.end(); ++wit)
+        for (auto cit = wit->second.begin(); cit!=wit->second.end(); ++cit)
+            cit->second *= 1.0-step_size;
+    for (auto wit = block_stats.cbegin(); wit!=block_stats.cend(); ++wit)
+        for (auto cit = wit->second.cbegin(); cit!=wit->second.cend(); ++cit)
+            running_stats[wit->first][cit->first] += step_size*scale*cit->second;
+}
 
-    // Handle some special cases where histogram pruning fails
-    // May happen for instance in the first training iterations
-    if ((int) pruned_tokens.size()>(2*num_tokens)) {
-        sort(pruned_tokens.begin(), pruned_tokens.end(), descending_token_sort);
-        pruned_tokens.resize(2*num_tokens);
-    }
+void
+interpolate_counts(ClassNgramCounts& running_counts,
+        const ClassNgramCounts& block_counts,
+        double step_size,
+        double scale)
+{
+    for (auto cit = running_counts.m_counts.begin(); cit!=running_counts.m_counts.end(); ++cit)
+        cit->second *= 1.0-step_size;
+    for (auto cit = block_counts.m_counts.cbegin(); cit!=block_counts.m_counts.cend(); ++cit)
+        running_counts.m_counts[cit->first] += step_size*scale*cit->second;
+}
 
-    tokens.swap(pruned_tokens);
+void histogram_prune(
+        vector<int>& tokens,
+        const TokenArena& arena,
+        int num_tokens)
+{
+    if ((int) tokens.size()<=num_tokens) return;
+    nth_element(tokens.begin(), tokens.begin()+num_tokens, tokens.end(), DescendingTokenSort(arena));
+    tokens.resize(num_tokens);
 }
 
 int
@@ -4,8 +4,10 @@
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 #include <memory>
+#include <mutex>
 
 #include "io.hh"
 #include "defs.hh"
@@ -23,7 +25,12 @@ public:
              max_line_length(100),
              prob_beam(10.0),
              verbose(false),
-             tagging(NO) { };
+             tagging(NO),
+             recombine(false),
+             forward_backward(false),
+             fold_sentences(false),
+             score_cache(nullptr),
+             categorymap(nullptr) { };
 
     unsigned int num_tokens;
     unsigned int num_final_tokens;
@@ -33,36 +40,45 @@ public:
     flt_type prob_beam;
     bool verbose;
     TaggingMode tagging;
+    // Merge tokens with the same class n-gram node and category generation context
+    bool recombine;
+    // Collect category statistics with forward-backward over the pruned lattice,
+    // without recombine the lattice only has the separate paths
+    bool forward_backward;
+    // Repeated sentences are decoded once, category sequences are written with weights
+    bool fold_sentences;
+    // Optional n-gram score cache shared by the training threads
+    ScoreCache* score_cache;
+    // Optional class index for each class n-gram word, see get_class_category_map
+    const std::vector<int>* categorymap;
 };
 
 class Token {
 public:
+    // Number of generation log probabilities kept in the token
+    static constexpr int GEN_CONTEXT_LENGTH = 4;
+
     Token()
             :m_category(-1),
              m_cng_node(-1),
              m_lp(0.0),
-             m_gen_lp(0.0),
-             m_prev_token(nullptr) { };
-
-    Token(Token* prev_token,
-            int category,
-            flt_type score)
+             m_prev_token(-1)
     {
-        m_category = category;
-        m_cng_node = prev_token->m_cng_node;
-        m_lp = score;
-        m_gen_lp = 0.0;
-        m_prev_token = prev_token;
+        for (int i = 0; i<GEN_CONTEXT_LENGTH; i++)
+            m_gen_lps[i] = 0.0;
     }
 
-    Token(Token& prev_token,
+    Token(const Token& prev_token,
+            int prev_token_idx,
             int category)
     {
         m_category = category;
         m_cng_node = prev_token.m_cng_node;
         m_lp = prev_token.m_lp;
-        m_gen_lp = 0.0;
-        m_prev_token = &prev_token;
+        m_gen_lps[0] = 0.0;
+        for (int i = 1; i<GEN_CONTEXT_LENGTH; i++)
+            m_gen_lps[i] = prev_token.m_gen_lps[i-1];
+        m_prev_token = prev_token_idx;
     }
 
     ~Token() { };
@@ -70,12 +86,56 @@ public:
     int m_category;
     int m_cng_node;
     flt_type m_lp;
-    flt_type m_gen_lp;
-    Token* m_prev_token;
+    // Category generation log probabilities of this and the previous tokens
+    flt_type m_gen_lps[GEN_CONTEXT_LENGTH];
+    // Index of the previous token in the arena, -1 for the initial token
+    int m_prev_token;
+};
+
+class TokenArc {
+public:
+    TokenArc(int from, int to, flt_type score)
+            :m_from(from), m_to(to), m_score(score) { };
+    int m_from;
+    int m_to;
+    flt_type m_score;
+};
+
+// Storage for the tokens of one sentence, cleared but not freed between sentences.
+// The arcs between the tokens are stored in the order of the word positions
+// if the lattice is needed.
+class TokenArena {
+public:
+    int add(const Token& tok)
+    {
+        m_tokens.push_back(tok);
+        return m_tokens.size()-1;
+    }
+    void add_arc(int from, int to, flt_type score) { m_arcs.emplace_back(from, to, score); }
+    Token& operator[](int idx) { return m_tokens[idx]; }
+    const Token& operator[](int idx) const { return m_tokens[idx]; }
+    int size() const { return m_tokens.size(); }
+    void clear()
+    {
+        m_tokens.clear();
+        m_arcs.clear();
+    }
+
+    std::vector<Token> m_tokens;
+    std::vector<TokenArc> m_arcs;
 };
 
 typedef std::map<int, flt_type> CategoryProbs;
 
+class CategoryEntry {
+public:
+    CategoryEntry(int category, flt_type gen_lp, flt_type mem_lp)
+            :m_category(category), m_gen_lp(gen_lp), m_mem_lp(mem_lp) { };
+    int m_category;
+    flt_type m_gen_lp;
+    flt_type m_mem_lp;
+};
+
 class Categories {
 public:
     Categories() { m_num_categories = 0; };
@@ -106,6 +166,15 @@ public:
     void read_category_gen_probs(std::string fname);
     void read_category_mem_probs(std::string fname);
 
+    // Builds the read-optimised form of the probabilities used in decoding,
+    // must be called again after the probabilities change
+    void freeze();
+    bool frozen() const { return m_word_offsets.size()>0; }
+    // Index of the word in the frozen form, -1 if the word has no membership probabilities
+    int get_word_index(const std::string& word) const;
+    const CategoryEntry* entries_begin(int word_idx) const { return m_entries.data()+m_word_offsets[word_idx]; }
+    const CategoryEntry* entries_end(int word_idx) const { return m_entries.data()+m_word_offsets[word_idx+1]; }
+
     int m_num_categories;
 
     // Sufficient statistics
@@ -115,16 +184,69 @@ public:
     std::map<std::string, CategoryProbs> m_category_gen_probs;
     // Final model p(w|c)
     std::map<std::string, CategoryProbs> m_category_mem_probs;
+
+    // Frozen form, the categories of word i are in m_entries[m_word_offsets[i]..m_word_offsets[i+1]-1]
+    std::unordered_map<std::string, int> m_word_indices;
+    std::vector<int> m_word_offsets;
+    std::vector<CategoryEntry> m_entries;
+};
+
+// Category statistics shared by the training threads. Categories of the frozen
+// category probabilities are accumulated to one dense table indexed as the entries,
+// other categories, as for tagged words, to maps. Both are sharded by the word index
+// and a word is updated under the lock of its shard.
+class CategoryStats {
+public:
+    CategoryStats(const Categories& categories, int num_shards = 64);
+    void accumulate(int word_idx, const std::string& word, int c, flt_type weight);
+    // Adds the statistics to the sufficient statistics of the categories
+    void get_stats(Categories& stats) const;
+
+    const Categories& m_categories;
+    std::vector<double> m_entry_stats;
+    std::vector<std::mutex> m_shard_mutexes;
+    std::vector<std::map<std::string, CategoryProbs>> m_shard_stats;
+};
+
+// Fractional class n-gram counts collected from the weighted category sequences.
+// The counts are written in the format read by ngram-count -read.
+class ClassNgramCounts {
+public:
+    ClassNgramCounts(int order = 3) :m_order(order) { };
+    static const int SENTENCE_BEGIN = -2;
+    static const int SENTENCE_END = -3;
+    // Symbol of a category index in the class n-gram model
+    static std::string symbol(int c);
+    // The first and last positions of the sequence are the sentence boundaries,
+    // unks are marked with -1
+    void accumulate(const std::vector<int>& catseq, double weight);
+    void accumulate(const ClassNgramCounts& counts);
+    void write(std::string fname) const;
+    int num_ngrams() const { return m_counts.size(); }
+
+    class NgramHash {
+    public:
+        size_t operator()(const std::vector<int>& ngram) const;
+    };
+
+    int m_order;
+    std::unordered_map<std::vector<int>, double, NgramHash> m_counts;
 };
 
+// Unigram counts of the categories, a word count is split evenly over the categories of the word
+void get_class_unigram_counts(
+        const std::map<std::string, int>& word_counts,
+        const Categories& wcl,
+        ClassNgramCounts& counts);
+
 void segment_sent(
         const std::vector<std::string>& sent,
         const LNNgram& ngram,
         const std::vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        std::vector<std::vector<Token*>>& tokens,
-        std::vector<Token*>& pointers,
+        std::vector<std::vector<int>>& tokens,
+        TokenArena& arena,
         unsigned long int* num_vocab_words = nullptr,
         unsigned long int* num_oov_words = nullptr,
         unsigned long int* num_unpruned_tokens = nullptr,
@@ -136,22 +258,44 @@ flt_type collect_stats(
         const std::vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        Categories& stats,
+        CategoryStats& stats,
         SimpleFileOutput* seqf,
+        ClassNgramCounts* counts,
         unsigned long int* num_vocab_words = nullptr,
         unsigned long int* num_oov_words = nullptr,
         unsigned long int* num_unpruned_tokens = nullptr,
-        unsigned long int* num_pruned_tokens = nullptr);
+        unsigned long int* num_pruned_tokens = nullptr,
+        unsigned int sent_count = 1);
 
 void limit_num_categories(
         std::map<std::string, CategoryProbs>& probs,
         int num_categories);
 
+// Expected category counts of the words in the corpus under the current model
+void get_expected_category_stats(
+        const std::map<std::string, int>& word_counts,
+        const Categories& categories,
+        std::map<std::string, CategoryProbs>& stats);
+
+// Stepwise EM, moves the running statistics towards the statistics of a block
+// with the step size, the block statistics are scaled to the size of the corpus
+void interpolate_stats(
+        std::map<std::string, CategoryProbs>& running_stats,
+        const std::map<std::string, CategoryProbs>& block_stats,
+        double step_size,
+        double scale);
+
+void interpolate_counts(
+        ClassNgramCounts& running_counts,
+        const ClassNgramCounts& block_counts,
+        double step_size,
+        double scale);
+
+// Keeps the num_tokens best tokens
 void histogram_prune(
-        std::vector<Token*>& tokens,
-        int num_tokens,
-        flt_type worst_score,
-        flt_type best_score);
+        std::vector<int>& tokens,
+        const TokenArena& arena,
+        int num_tokens);
 
 int get_word_counts(
         std::string corpusfname,
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <sstream>
+
+#include "Corpus.hh"
+#include "defs.hh"
+#include "io.hh"
+
+using namespace std;
+
+static inline unsigned long long
+hash_sentence(const vector<int>& sent)
+{
+    unsigned long long hash = sent.size();
+    for (auto wit = sent.begin(); wit!=sent.end(); ++wit) {
+        hash ^= (unsigned int) *wit;
+        hash *= 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+void
+Corpus::set_vocabulary(const set<string>& vocab)
+{
+    m_words.assign(vocab.begin(), vocab.end());
+    if (vocab.find(UNK_SYMBOL)==vocab.end()) m_words.push_back(UNK_SYMBOL);
+    m_word_ids.clear();
+    for (int i = 0; i<(int) m_words.size(); i++)
+        m_word_ids[m_words[i]] = i;
+    m_unk_id = m_word_ids[UNK_SYMBOL];
+}
+
+int
+Corpus::word_id(const string& word)
+{
+    auto wit = m_word_ids.find(word);
+    if (wit!=m_word_ids.end()) return wit->second;
+    if (m_unk_id!=-1) return m_unk_id;
+    m_words.push_back(word);
+    m_word_ids[word] = m_words.size()-1;
+    return m_words.size()-1;
+}
+
+bool
+Corpus::process_line(const string& line, unsigned int max_line_length, vector<int>& sent)
+{
+    sent.clear();
+    stringstream ss(line);
+    string word;
+    while (ss >> word) {
+        if (word==SENTENCE_BEGIN_SYMBOL || word==SENTENCE_END_SYMBOL) continue;
+        sent.push_back(word_id(word));
+    }
+    return sent.size()>0 && sent.size()<=max_line_length;
+}
+
+void
+Corpus::read(string corpusfname, unsigned int max_line_length, bool fold_sentences)
+{
+    SimpleFileInput corpusf(corpusfname);
+    unordered_multimap<unsigned long long, unsigned long int> sent_lookup;
+    vector<int> word_counts;
+    int num_lines = 0;
+    if (m_sent_offsets.size()==0) m_sent_offsets.push_back(0);
+    string line;
+    vector<int> sent;
+    while (corpusf.getline(line)) {
+        if (line.length()==0) continue;
+        num_lines++;
+        bool keep = process_line(line, max_line_length, sent);
+        word_counts.resize(m_words.size(), 0);
+        for (auto wit = sent.begin(); wit!=sent.end(); ++wit)
+            word_counts[*wit]++;
+        if (!keep) continue;
+        m_num_sentences++;
+
+        if (fold_sentences) {
+            unsigned long long hash = hash_sentence(sent);
+            auto range = sent_lookup.equal_range(hash);
+            auto sit = range.first;
+            for (; sit!=range.second; ++sit)
+                if (same_sentence(sit->second, sent)) break;
+            if (sit!=range.second) {
+                m_sentence_counts[sit->second]++;
+                continue;
+            }
+            sent_lookup.insert(make_pair(hash, m_sentence_counts.size()));
+        }
+        m_sent_words.insert(m_sent_words.end(), sent.begin(), sent.end());
+        m_sent_offsets.push_back(m_sent_words.size());
+        m_sentence_counts.push_back(1);
+    }
+
+    word_counts.resize(m_words.size(), 0);
+    for (int i = 0; i<(int) m_words.size(); i++)
+        if (word_counts[i]>0) m_word_counts[m_words[i]] = word_counts[i];
+    m_word_counts[SENTENCE_BEGIN_SYMBOL] = num_lines;
+    m_word_counts[SENTENCE_END_SYMBOL] = num_lines;
+}
+
+bool
+Corpus::same_sentence(unsigned long int sent_idx, const vector<int>& sent) const
+{
+    unsigned long int first_word = m_sent_offsets[sent_idx];
+    if (m_sent_offsets[sent_idx+1]-first_word!=sent.size()) return false;
+    return equal(sent.begin(), sent.end(), m_sent_words.begin()+first_word);
+}
+
+void
+Corpus::get_sentence(unsigned long int sent_idx,
+        vector<int>& sent) const
+{
+    sent.assign(m_sent_words.begin()+m_sent_offsets[sent_idx],
+            m_sent_words.begin()+m_sent_offsets[sent_idx+1]);
+}
+
+void
+Corpus::get_in_vocabulary(const set<string>& vocab,
+        vector<char>& in_vocabulary) const
+{
+    in_vocabulary.resize(m_words.size());
+    for (int i = 0; i<(int) m_words.size(); i++)
+        in_vocabulary[i] = vocab.find(m_words[i])!=vocab.end();
+}
+
+void
+Corpus::get_sentence(unsigned long int sent_idx,
+        const vector<char>& in_vocabulary,
+        vector<string>& sent) const
+{
+    unsigned long int first_word = m_sent_offsets[sent_idx];
+    sent.resize(m_sent_offsets[sent_idx+1]-first_word);
+    for (unsigned int i = 0; i<sent.size(); i++) {
+        int word = m_sent_words[first_word+i];
+        sent[i] = in_vocabulary[word] ? m_words[word] : UNK_SYMBOL;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef CORPUS
+#define CORPUS
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Sentences of a corpus as word indices, stored one after another. With folding,
+// each distinct sentence is stored once with its number of occurrences. The stored
+// sentences are found by a 64-bit hash of the indices and compared word by word.
+class Corpus {
+public:
+    Corpus() :m_unk_id(-1), m_num_sentences(0) { };
+    // Closes the vocabulary, words outside it are read as the unk symbol.
+    // Without a vocabulary, the words of the corpus are the vocabulary.
+    void set_vocabulary(const std::set<std::string>& vocab);
+    // Reads the whole corpus, empty lines and lines longer than max_line_length are skipped
+    void read(std::string corpusfname, unsigned int max_line_length, bool fold_sentences);
+    // Maps the words of a line to indices, returns false for lines that are skipped
+    bool process_line(const std::string& line, unsigned int max_line_length, std::vector<int>& sent);
+    // Number of stored sentences, the distinct sentences with folding
+    unsigned long int size() const { return m_sentence_counts.size(); }
+    void get_sentence(unsigned long int sent_idx,
+            std::vector<int>& sent) const;
+    void get_sentence(unsigned long int sent_idx,
+            const std::vector<char>& in_vocabulary,
+            std::vector<std::string>& sent) const;
+    void get_in_vocabulary(const std::set<std::string>& vocab,
+            std::vector<char>& in_vocabulary) const;
+
+    std::vector<std::string> m_words;
+    std::vector<unsigned int> m_sentence_counts;
+    unsigned long int m_num_sentences;
+    // Counts over all lines, as from get_word_counts
+    std::map<std::string, int> m_word_counts;
+
+private:
+    int word_id(const std::string& word);
+    bool same_sentence(unsigned long int sent_idx, const std::vector<int>& sent) const;
+
+    std::unordered_map<std::string, int> m_word_ids;
+    int m_unk_id;
+    std::vector<int> m_sent_words;
+    std::vector<unsigned long int> m_sent_offsets;
+};
+
+#endif /* CORPUS */
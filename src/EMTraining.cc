@@ -0,0 +1,71 @@
+#include <set>
+#include <sstream>
+
+#include "EMTraining.hh"
+#include "defs.hh"
+#include "io.hh"
+
+using namespace std;
+
+void
+read_schedule(string cfgfname,
+        vector<Iteration>& schedule)
+{
+    SimpleFileInput cfgf(cfgfname);
+    string line;
+    string section;
+    while (cfgf.getline(line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start==string::npos || line[start]=='#' || line[start]==';') continue;
+        if (line[start]=='[') {
+            section = line.substr(start+1, line.find(']')-start-1);
+            continue;
+        }
+        if (section!="training") continue;
+        // Python configparser reads an indented line as a continuation of the previous value
+        if (start>0) throw string("Indented line in the training schedule: "+line);
+
+        size_t sep = line.find_first_of(":=");
+        if (sep==string::npos) throw string("Problem reading training schedule line: "+line);
+        Iteration iteration;
+        iteration.m_name = line.substr(start, line.find_last_not_of(" \t", sep-1)-start+1);
+
+        vector<string> fields;
+        stringstream ss(line.substr(sep+1));
+        string field;
+        while (getline(ss, field, ',')) {
+            size_t fstart = field.find_first_not_of(" \t");
+            size_t fend = field.find_last_not_of(" \t\r");
+            fields.push_back(fstart==string::npos ? "" : field.substr(fstart, fend-fstart+1));
+        }
+        if (fields.size()!=5) throw string("Problem reading training schedule line: "+line);
+        iteration.m_smoothing = get_smoothing(fields[0]);
+        iteration.m_order = str2int(fields[1]);
+        iteration.m_update_categories = fields[2]=="true" || fields[2]=="True" || fields[2]=="1";
+        iteration.m_tagging = static_cast<TaggingMode>(str2int(fields[3]));
+        iteration.m_max_categories = str2int(fields[4]);
+        schedule.push_back(iteration);
+    }
+    if (schedule.size()==0) throw string("No iterations in the training schedule");
+}
+
+void
+read_class_vocabulary(string initfname,
+        vector<string>& vocabulary)
+{
+    vocabulary.clear();
+    vocabulary.push_back(SENTENCE_BEGIN_SYMBOL);
+    vocabulary.push_back(SENTENCE_END_SYMBOL);
+    vocabulary.push_back(UNK_SYMBOL);
+    set<string> categories;
+    SimpleFileInput initf(initfname);
+    string line;
+    while (initf.getline(line)) {
+        stringstream ss(line);
+        string token;
+        ss >> token;
+        while (ss >> token)
+            if (categories.insert(token).second)
+                vocabulary.push_back(token);
+    }
+}
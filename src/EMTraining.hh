@@ -0,0 +1,30 @@
+#ifndef EM_TRAINING
+#define EM_TRAINING
+
+#include <string>
+#include <vector>
+
+#include "Categories.hh"
+#include "NgramEstimation.hh"
+
+class Iteration {
+public:
+    std::string m_name;
+    Smoothing m_smoothing;
+    int m_order;
+    bool m_update_categories;
+    TaggingMode m_tagging;
+    int m_max_categories;
+};
+
+// Reads the [training] section of the trainer configuration,
+// each line is iterid: smoothing,order,update category probabilities,tag,maximum number of categories,
+// 0 for no limit
+void read_schedule(std::string cfgfname,
+        std::vector<Iteration>& schedule);
+
+// Categories of the initialization file are the class n-gram vocabulary
+void read_class_vocabulary(std::string initfname,
+        std::vector<std::string>& vocabulary);
+
+#endif /* EM_TRAINING */
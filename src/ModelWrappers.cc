@@ -85,7 +85,7 @@ WordNgram::WordNgram(
         string arpa_filename,
         bool unk_root_node)
 {
-    m_ln_arpa_model.read_arpa(arpa_filename);
+    m_ln_arpa_model.read_model(arpa_filename);
     m_unk_root_node = unk_root_node;
     start_sentence();
 }
@@ -140,7 +140,7 @@ ClassNgram::ClassNgram(
         string cmemprobs_filename,
         bool unk_root_node)
 {
-    m_ln_arpa_model.read_arpa(arpa_filename);
+    m_ln_arpa_model.read_model(arpa_filename);
     m_unk_root_node = unk_root_node;
     m_num_classes = read_class_memberships(cmemprobs_filename, m_class_memberships);
     m_indexmap = get_class_index_map(m_num_classes, m_ln_arpa_model);
@@ -203,12 +203,13 @@ CategoryNgram::CategoryNgram(
         int max_tokens,
         double beam)
 {
-    m_ln_arpa_model.read_arpa(arpa_filename);
+    m_ln_arpa_model.read_model(arpa_filename);
     m_word_categories.read_category_gen_probs(cgenprobs_filename);
     m_word_categories.read_category_mem_probs(cmemprobs_filename);
     m_unk_root_node = unk_root_node;
     m_indexmap = get_class_index_map(m_word_categories.num_categories(), m_ln_arpa_model);
     m_history = nullptr;
+    m_score_cache.reset(new ScoreCache(m_ln_arpa_model, 16));
     m_max_tokens = max_tokens;
     m_beam = beam;
     start_sentence();
@@ -259,7 +260,7 @@ CategoryNgram::likelihood(string word)
                     m_indexmap,
                     num_vocab_words, num_oov_words,
                     word, *m_history,
-                    m_unk_root_node, m_max_tokens, m_beam);
+                    m_unk_root_node, m_max_tokens, m_beam, m_score_cache.get());
     }
     else {
         CatPerplexity::likelihood(
@@ -268,7 +269,7 @@ CategoryNgram::likelihood(string word)
                 m_indexmap,
                 num_vocab_words, num_oov_words,
                 word, *m_history,
-                m_unk_root_node, m_max_tokens, m_beam);
+                m_unk_root_node, m_max_tokens, m_beam, m_score_cache.get());
     }
     return ln_log_prob;
 }
@@ -284,7 +285,7 @@ CategoryNgram::sentence_end_likelihood()
             m_indexmap,
             num_vocab_words, num_oov_words,
             SENTENCE_END_SYMBOL, *m_history,
-            m_unk_root_node, m_max_tokens, m_beam);
+            m_unk_root_node, m_max_tokens, m_beam, m_score_cache.get());
 
 }
 
@@ -293,7 +294,7 @@ SubwordNgram::SubwordNgram(
         string arpa_filename,
         string word_segs_filename)
 {
-    m_ln_arpa_model.read_arpa(arpa_filename);
+    m_ln_arpa_model.read_model(arpa_filename);
     read_word_segs(word_segs_filename, true);
 
     m_root_node = m_ln_arpa_model.root_node;
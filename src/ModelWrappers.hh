@@ -1,6 +1,7 @@
 #ifndef MODEL_WRAPPERS
 #define MODEL_WRAPPERS
 
+#include <memory>
 #include <string>
 
 #include "Categories.hh"
@@ -71,6 +72,8 @@ private:
     std::vector<int> m_indexmap;
     Categories m_word_categories;
     CatPerplexity::CategoryHistory *m_history;
+    // Refers to m_ln_arpa_model, the owning pointer also makes the class non-copyable
+    std::unique_ptr<ScoreCache> m_score_cache;
     int m_max_tokens;
     int m_beam;
 };
@@ -1,55 +1,177 @@
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include "Ngram.hh"
 #include "str.hh"
 
 using namespace std;
 
+template<typename T, bool PROBS, Ngram::NodeLayout L, int MAX_ORDER>
 int
-Ngram::score(int node_idx, int word, double& score) const
+Ngram::score_kernel(int node_idx, int word, T& score) const
 {
-    while (true) {
-        int tmp = find_node(node_idx, word);
+    // The context may be a highest order node, so one extra backoff is allowed
+    for (int i = 0; MAX_ORDER==0 || i<=MAX_ORDER; i++) {
+        int tmp = find_node<L>(node_idx, word);
         if (tmp!=-1) {
-            node_idx = tmp;
-            score += nodes[node_idx].prob;
-            if (nodes[node_idx].first_arc==-1)
-                return nodes[node_idx].backoff_node;
-            else
-                return node_idx;
-        }
-        else {
-            score += nodes[node_idx].backoff_prob;
-            node_idx = nodes[node_idx].backoff_node;
+            if constexpr (PROBS) score += node_prob<L>(tmp);
+            return context_node<L>(tmp);
         }
+        if constexpr (PROBS) score += node_backoff_prob<L>(node_idx);
+        node_idx = node_backoff_node<L>(node_idx);
     }
 
     throw string("Problem in assigning an n-gram score.");
 }
 
+template<typename T, bool PROBS, Ngram::NodeLayout L>
+int
+Ngram::score_dispatch_order(int node_idx, int word, T& score) const
+{
+    switch (max_order) {
+        case 2:
+            return score_kernel<T, PROBS, L, 2>(node_idx, word, score);
+        case 3:
+            return score_kernel<T, PROBS, L, 3>(node_idx, word, score);
+        case 4:
+            return score_kernel<T, PROBS, L, 4>(node_idx, word, score);
+        default:
+            return score_kernel<T, PROBS, L, 0>(node_idx, word, score);
+    }
+}
+
+template<typename T, bool PROBS>
+int
+Ngram::score_dispatch(int node_idx, int word, T& score) const
+{
+    if (layout==FLOAT_NODES)
+        return score_dispatch_order<T, PROBS, FLOAT_NODES>(node_idx, word, score);
+    else if (layout==QUANTIZED_NODES)
+        return score_dispatch_order<T, PROBS, QUANTIZED_NODES>(node_idx, word, score);
+    return score_dispatch_order<T, PROBS, FULL_NODES>(node_idx, word, score);
+}
+
+int
+Ngram::score(int node_idx, int word, double& score) const
+{
+    return score_dispatch<double, true>(node_idx, word, score);
+}
+
 int
 Ngram::score(int node_idx, int word, float& score) const
 {
+    return score_dispatch<float, true>(node_idx, word, score);
+}
+
+int
+Ngram::advance(int node_idx, int word) const
+{
+    float unused = 0.0;
+    return score_dispatch<float, false>(node_idx, word, unused);
+}
+
+template<bool PROBS>
+void
+Ngram::score_words(int node_idx,
+        const vector<int>& words,
+        vector<double>* scores,
+        vector<int>& next_nodes) const
+{
+    if constexpr (PROBS) scores->assign(words.size(), 0.0);
+    next_nodes.assign(words.size(), -1);
+
+    // Words are looked up in sorted order for locality in the arc arrays
+    static thread_local vector<int> remaining;
+    remaining.resize(words.size());
+    for (int i = 0; i<(int) words.size(); i++)
+        remaining[i] = i;
+    sort(remaining.begin(), remaining.end(),
+            [&words](int i, int j) { return words[i]<words[j]; });
+
+    double backoff_score = 0.0;
     while (true) {
-        int tmp = find_node(node_idx, word);
-        if (tmp!=-1) {
-            node_idx = tmp;
-            score += nodes[node_idx].prob;
-            if (nodes[node_idx].first_arc==-1)
-                return nodes[node_idx].backoff_node;
-            else
-                return node_idx;
-        }
-        else {
-            score += nodes[node_idx].backoff_prob;
-            node_idx = nodes[node_idx].backoff_node;
+        int num_remaining = 0;
+        for (auto rit = remaining.begin(); rit!=remaining.end(); ++rit) {
+            int tmp = find_node(node_idx, words[*rit]);
+            if (tmp!=-1) {
+                if constexpr (PROBS) (*scores)[*rit] = backoff_score+node_prob(tmp);
+                next_nodes[*rit] = context_node(tmp);
+            }
+            else remaining[num_remaining++] = *rit;
         }
+        remaining.resize(num_remaining);
+        if (num_remaining==0) break;
+        if constexpr (PROBS) backoff_score += node_backoff_prob(node_idx);
+        node_idx = node_backoff_node(node_idx);
     }
+}
 
-    throw string("Problem in assigning an n-gram score.");
+void
+Ngram::score(int node_idx,
+        const vector<int>& words,
+        vector<double>& scores,
+        vector<int>& next_nodes) const
+{
+    score_words<true>(node_idx, words, &scores, next_nodes);
+}
+
+void
+Ngram::advance(int node_idx,
+        const vector<int>& words,
+        vector<int>& next_nodes) const
+{
+    score_words<false>(node_idx, words, nullptr, next_nodes);
+}
+
+void
+Ngram::score(const vector<int>& node_idxs,
+        int word,
+        vector<double>& scores,
+        vector<int>& next_nodes) const
+{
+    scores.resize(node_idxs.size());
+    next_nodes.resize(node_idxs.size());
+
+    // Results for each visited context, backoff chains often share their tails
+    static thread_local unordered_map<int, pair<double, int>> results;
+    static thread_local vector<int> chain;
+    results.clear();
+
+    for (unsigned int i = 0; i<node_idxs.size(); i++) {
+        int node_idx = node_idxs[i];
+        chain.clear();
+        pair<double, int> result;
+        while (true) {
+            auto rit = results.find(node_idx);
+            if (rit!=results.end()) {
+                result = rit->second;
+                break;
+            }
+            int tmp = find_node(node_idx, word);
+            if (tmp!=-1) {
+                result = make_pair(node_prob(tmp), context_node(tmp));
+                results[node_idx] = result;
+                break;
+            }
+            chain.push_back(node_idx);
+            node_idx = node_backoff_node(node_idx);
+        }
+        for (auto cit = chain.rbegin(); cit!=chain.rend(); ++cit) {
+            result.first += node_backoff_prob(*cit);
+            results[*cit] = result;
+        }
+        scores[i] = result.first;
+        next_nodes[i] = result.second;
+    }
 }
 
 void
@@ -57,29 +179,458 @@ Ngram::get_reverse_bigrams(map<int, vector<int> >& reverse_bigrams)
 {
     if (order()!=2) throw string("Error, not a bigram model.");
 
-    Node& root_nd = nodes[root_node];
-    for (int i = root_nd.first_arc; i<=root_nd.last_arc; i++) {
-        int first_word = arc_words[i];
-        Node& arc_target_node = nodes[arc_target_nodes[i]];
-        if (arc_target_node.first_arc==-1) continue;
-        for (int j = arc_target_node.first_arc; j<=arc_target_node.last_arc; j++) {
-            int second_word = arc_words[j];
+    int root_first_arc, root_last_arc;
+    node_arcs(root_node, root_first_arc, root_last_arc);
+    for (int i = root_first_arc; i<=root_last_arc; i++) {
+        int first_word = arc_word(i);
+        int first_arc, last_arc;
+        node_arcs(arc_target_node(i), first_arc, last_arc);
+        if (first_arc==-1) continue;
+        for (int j = first_arc; j<=last_arc; j++) {
+            int second_word = arc_word(j);
             reverse_bigrams[second_word].push_back(first_word);
         }
     }
 }
 
+inline unsigned int
+arc_hash(int word)
+{
+    return (unsigned int) word*2654435761U;
+}
+
+void
+Ngram::build_lookup_tables()
+{
+    root_arc_targets.assign(vocabulary.size(), -1);
+    int first_arc, last_arc;
+    node_arcs(root_node, first_arc, last_arc);
+    if (first_arc!=-1)
+        for (int a = first_arc; a<=last_arc; a++)
+            root_arc_targets[arc_word(a)] = arc_target_node(a);
+
+    // Open addressing with a load factor of at most 0.5, empty slots have word -1
+    node_arc_hash_tables.clear();
+    arc_hash_tables.clear();
+    arc_hash_slots.clear();
+    if (hash_fanout_threshold<=0) return;
+    node_arc_hash_tables.assign(num_nodes(), -1);
+    Arc empty_slot;
+    empty_slot.word = -1;
+    empty_slot.target_node = -1;
+    for (int node_idx = 0; node_idx<num_nodes(); node_idx++) {
+        if (node_idx==root_node) continue;
+        node_arcs(node_idx, first_arc, last_arc);
+        if (first_arc==-1 || last_arc-first_arc+1<hash_fanout_threshold) continue;
+        unsigned int size = 1;
+        while (size<2*(unsigned int) (last_arc-first_arc+1)) size <<= 1;
+        node_arc_hash_tables[node_idx] = arc_hash_tables.size();
+        arc_hash_tables.push_back(ArcHashTable());
+        ArcHashTable& table = arc_hash_tables.back();
+        table.offset = arc_hash_slots.size();
+        table.mask = size-1;
+        arc_hash_slots.resize(arc_hash_slots.size()+size, empty_slot);
+        for (int a = first_arc; a<=last_arc; a++) {
+            unsigned int slot = arc_hash(arc_word(a)) & table.mask;
+            while (arc_hash_slots[table.offset+slot].word!=-1)
+                slot = (slot+1) & table.mask;
+            arc_hash_slots[table.offset+slot].word = arc_word(a);
+            arc_hash_slots[table.offset+slot].target_node = arc_target_node(a);
+        }
+    }
+}
+
+template<Ngram::NodeLayout L>
 int
 Ngram::find_node(int node_idx, int word) const
 {
-    int first_arc = nodes[node_idx].first_arc;
+    if (node_idx==root_node && root_arc_targets.size()>0)
+        return (word>=0 && word<(int) root_arc_targets.size()) ? root_arc_targets[word] : -1;
+
+    int first_arc, last_arc;
+    node_arcs<L>(node_idx, first_arc, last_arc);
     if (first_arc==-1) return -1;
-    int last_arc = nodes[node_idx].last_arc+1;
 
-    auto lower_b = lower_bound(arc_words.begin()+first_arc, arc_words.begin()+last_arc, word);
-    int arc_idx = lower_b-arc_words.begin();
-    if (arc_idx==last_arc || *lower_b!=word) return -1;
-    return arc_target_nodes[arc_idx];
+    if (last_arc-first_arc+1>=hash_fanout_threshold && arc_hash_tables.size()>0
+            && node_arc_hash_tables[node_idx]!=-1) {
+        const ArcHashTable& table = arc_hash_tables[node_arc_hash_tables[node_idx]];
+        unsigned int slot = arc_hash(word) & table.mask;
+        while (true) {
+            const Arc& arc = arc_hash_slots[table.offset+slot];
+            if (arc.word==word) return arc.target_node;
+            if (arc.word==-1) return -1;
+            slot = (slot+1) & table.mask;
+        }
+    }
+
+    if constexpr (L!=FULL_NODES) {
+        auto lower_b = lower_bound(arcs.begin()+first_arc, arcs.begin()+last_arc+1, word,
+                [](const Arc& arc, int w) { return arc.word<w; });
+        if (lower_b==arcs.begin()+last_arc+1 || lower_b->word!=word) return -1;
+        return lower_b->target_node;
+    }
+    else {
+        auto lower_b = lower_bound(arc_words.begin()+first_arc, arc_words.begin()+last_arc+1, word);
+        int arc_idx = lower_b-arc_words.begin();
+        if (arc_idx==last_arc+1 || *lower_b!=word) return -1;
+        return arc_target_nodes[arc_idx];
+    }
+}
+
+int
+Ngram::find_node(int node_idx, int word) const
+{
+    if (layout==FLOAT_NODES) return find_node<FLOAT_NODES>(node_idx, word);
+    else if (layout==QUANTIZED_NODES) return find_node<QUANTIZED_NODES>(node_idx, word);
+    return find_node<FULL_NODES>(node_idx, word);
+}
+
+// Covers the sorted values greedily with intervals of width 2*tolerance,
+// the codebook entries are the interval midpoints
+static int
+cover_values(const vector<float>& values,
+        float tolerance,
+        vector<float>* codebook = nullptr)
+{
+    int num_intervals = 0;
+    size_t i = 0;
+    while (i<values.size()) {
+        size_t j = i;
+        while (j<values.size() && values[j]<=values[i]+2*tolerance) j++;
+        if (codebook!=nullptr) codebook->push_back(0.5*(values[i]+values[j-1]));
+        num_intervals++;
+        i = j;
+    }
+    return num_intervals;
+}
+
+// Minimises the maximum quantisation error, the tolerance is found by bisection
+static void
+build_codebook(vector<float> values,
+        int num_levels,
+        vector<float>& codebook)
+{
+    sort(values.begin(), values.end());
+    values.erase(unique(values.begin(), values.end()), values.end());
+    codebook.clear();
+    if ((int) values.size()<=num_levels) {
+        codebook = values;
+        return;
+    }
+
+    float min_tolerance = 0.0;
+    float max_tolerance = values.back()-values.front();
+    for (int i = 0; i<50; i++) {
+        float tolerance = 0.5*(min_tolerance+max_tolerance);
+        if (cover_values(values, tolerance)<=num_levels)
+            max_tolerance = tolerance;
+        else
+            min_tolerance = tolerance;
+    }
+    cover_values(values, max_tolerance, &codebook);
+}
+
+static unsigned short int
+codebook_index(const vector<float>& codebook,
+        float value)
+{
+    auto it = lower_bound(codebook.begin(), codebook.end(), value);
+    if (it==codebook.end()) return codebook.size()-1;
+    if (it==codebook.begin()) return 0;
+    if (value-*(it-1)<*it-value) --it;
+    return it-codebook.begin();
+}
+
+void
+Ngram::compact(int bits)
+{
+    if (layout!=FULL_NODES) throw string("Model is already compact");
+    if (bits!=32 && bits!=16)
+        throw string("Invalid number of bits for compact probabilities: "+to_string(bits));
+
+    int num_nodes = nodes.size();
+    int num_arcs = arc_words.size();
+    vector<int> arc_starts(num_nodes+1);
+    arc_starts[num_nodes] = num_arcs;
+    for (int i = num_nodes-1; i>=0; i--) {
+        if (nodes[i].first_arc==-1)
+            arc_starts[i] = arc_starts[i+1];
+        else if (nodes[i].last_arc+1!=arc_starts[i+1])
+            throw string("Arcs are not in node order, can not compact the model");
+        else
+            arc_starts[i] = nodes[i].first_arc;
+    }
+
+    arcs.resize(num_arcs);
+    for (int i = 0; i<num_arcs; i++) {
+        arcs[i].word = arc_words[i];
+        arcs[i].target_node = arc_target_nodes[i];
+    }
+
+    // The last node is a sentinel for the arc range of the last real node
+    if (bits==32) {
+        float_nodes.resize(num_nodes+1);
+        for (int i = 0; i<=num_nodes; i++) {
+            FloatNode& nd = float_nodes[i];
+            nd.prob = i<num_nodes ? nodes[i].prob : 0.0;
+            nd.backoff_prob = i<num_nodes ? nodes[i].backoff_prob : 0.0;
+            nd.backoff_node = i<num_nodes ? nodes[i].backoff_node : -1;
+            nd.first_arc = arc_starts[i];
+        }
+        layout = FLOAT_NODES;
+    }
+    else {
+        int num_levels = 1 << bits;
+        vector<float> probs, backoff_probs;
+        for (int i = 0; i<num_nodes; i++) {
+            probs.push_back(nodes[i].prob);
+            if (nodes[i].backoff_prob!=0.0) backoff_probs.push_back(nodes[i].backoff_prob);
+        }
+        build_codebook(probs, num_levels, prob_codebook);
+        // Zero backoffs are kept exact
+        build_codebook(backoff_probs, num_levels-1, backoff_codebook);
+        backoff_codebook.insert(lower_bound(backoff_codebook.begin(), backoff_codebook.end(), 0.0f), 0.0f);
+
+        quantized_nodes.resize(num_nodes+1);
+        for (int i = 0; i<=num_nodes; i++) {
+            QuantizedNode& nd = quantized_nodes[i];
+            nd.prob = codebook_index(prob_codebook, i<num_nodes ? nodes[i].prob : 0.0);
+            nd.backoff_prob = codebook_index(backoff_codebook, i<num_nodes ? nodes[i].backoff_prob : 0.0);
+            nd.backoff_node = i<num_nodes ? nodes[i].backoff_node : -1;
+            nd.first_arc = arc_starts[i];
+        }
+        layout = QUANTIZED_NODES;
+    }
+
+    nodes = NgramArray<Node>();
+    arc_words = NgramArray<int>();
+    arc_target_nodes = NgramArray<int>();
+    model_file.reset();
+}
+
+// Binary model layout, in native byte order:
+// header, n-gram counts for each order, node layout specific sections
+// and null-terminated vocabulary strings.
+// Full nodes: nodes, arc words, arc target nodes
+// Float nodes: nodes including the sentinel, arcs
+// Quantized nodes: codebook sizes, codebooks, nodes including the sentinel, arcs
+// Each section starts at an 8-byte boundary.
+static const char BINARY_MAGIC[8] = {'N', 'G', 'R', 'A', 'M', 'B', 'I', 'N'};
+static const int BINARY_VERSION = 1;
+
+class BinaryHeader {
+public:
+    char magic[8];
+    int32_t version;
+    int32_t node_size;
+    int32_t natural_log_probs;
+    int32_t max_order;
+    int32_t root_node;
+    int32_t sentence_start_node;
+    int32_t sentence_start_symbol_idx;
+    int32_t sentence_end_symbol_idx;
+    int32_t unk_symbol_idx;
+    int32_t layout;
+    int64_t num_nodes;
+    int64_t num_arcs;
+    int64_t num_vocabulary;
+    int64_t vocabulary_bytes;
+};
+
+inline size_t
+binary_align(size_t offset)
+{
+    return (offset+7) & ~((size_t) 7);
+}
+
+bool
+Ngram::is_binary_model(string modelfname)
+{
+    ifstream modelf(modelfname, ios_base::in | ios_base::binary);
+    char magic[sizeof(BINARY_MAGIC)];
+    if (!modelf.read(magic, sizeof(magic))) return false;
+    return memcmp(magic, BINARY_MAGIC, sizeof(magic))==0;
+}
+
+void
+Ngram::read_model(string modelfname)
+{
+    if (is_binary_model(modelfname))
+        read_binary(modelfname);
+    else
+        read_arpa(modelfname);
+}
+
+void
+Ngram::write_binary(string binfname)
+{
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    header.version = BINARY_VERSION;
+    if (layout==FLOAT_NODES) header.node_size = sizeof(FloatNode);
+    else if (layout==QUANTIZED_NODES) header.node_size = sizeof(QuantizedNode);
+    else header.node_size = sizeof(Node);
+    header.layout = layout;
+    header.natural_log_probs = natural_log_probs() ? 1 : 0;
+    header.max_order = max_order;
+    header.root_node = root_node;
+    header.sentence_start_node = sentence_start_node;
+    header.sentence_start_symbol_idx = sentence_start_symbol_idx;
+    header.sentence_end_symbol_idx = sentence_end_symbol_idx;
+    header.unk_symbol_idx = unk_symbol_idx;
+    header.num_nodes = num_nodes();
+    header.num_arcs = layout==FULL_NODES ? arc_words.size() : arcs.size();
+    header.num_vocabulary = vocabulary.size();
+    for (auto vit = vocabulary.begin(); vit!=vocabulary.end(); ++vit)
+        header.vocabulary_bytes += vit->length()+1;
+
+    ofstream binf(binfname, ios_base::out | ios_base::binary);
+    if (!binf) throw string("Could not open file for writing: "+binfname);
+    size_t offset = 0;
+    auto write_section = [&](const void* data, size_t len) {
+        size_t start = binary_align(offset);
+        static const char zeros[8] = {0};
+        binf.write(zeros, start-offset);
+        binf.write(static_cast<const char*>(data), len);
+        offset = start+len;
+    };
+
+    write_section(&header, sizeof(header));
+    vector<int64_t> counts;
+    for (int order = 1; order<=max_order; order++)
+        counts.push_back(ngram_counts_per_order.at(order));
+    write_section(counts.data(), counts.size()*sizeof(int64_t));
+    if (layout==FULL_NODES) {
+        write_section(nodes.data(), nodes.size()*sizeof(Node));
+        write_section(arc_words.data(), arc_words.size()*sizeof(int));
+        write_section(arc_target_nodes.data(), arc_target_nodes.size()*sizeof(int));
+    }
+    else {
+        if (layout==FLOAT_NODES)
+            write_section(float_nodes.data(), float_nodes.size()*sizeof(FloatNode));
+        else {
+            int64_t codebook_sizes[2] = {(int64_t) prob_codebook.size(), (int64_t) backoff_codebook.size()};
+            write_section(codebook_sizes, sizeof(codebook_sizes));
+            write_section(prob_codebook.data(), prob_codebook.size()*sizeof(float));
+            write_section(backoff_codebook.data(), backoff_codebook.size()*sizeof(float));
+            write_section(quantized_nodes.data(), quantized_nodes.size()*sizeof(QuantizedNode));
+        }
+        write_section(arcs.data(), arcs.size()*sizeof(Arc));
+    }
+    string vocabulary_data;
+    vocabulary_data.reserve(header.vocabulary_bytes);
+    for (auto vit = vocabulary.begin(); vit!=vocabulary.end(); ++vit)
+        vocabulary_data.append(vit->c_str(), vit->length()+1);
+    write_section(vocabulary_data.data(), vocabulary_data.size());
+
+    if (!binf) throw string("Problem writing binary model: "+binfname);
+}
+
+void
+Ngram::read_binary(string binfname)
+{
+    const string format_error("Invalid binary model "+binfname);
+
+    model_file = make_shared<MMapFile>(binfname, true);
+    if (!model_file->is_open()) throw string("Could not open binary model "+binfname);
+    char* data = model_file->data();
+    size_t size = model_file->size();
+
+    size_t offset = 0;
+    auto section = [&](size_t len) {
+        size_t start = binary_align(offset);
+        if (start+len>size) throw format_error;
+        offset = start+len;
+        return data+start;
+    };
+    // Section of count elements, the count is checked before the length is computed
+    auto array_section = [&](int64_t count, size_t elem_size) {
+        if (count<0 || (uint64_t) count>size/elem_size) throw format_error;
+        return section(count*elem_size);
+    };
+
+    BinaryHeader header;
+    memcpy(&header, section(sizeof(header)), sizeof(header));
+    if (memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC))!=0) throw format_error;
+    if (header.version!=BINARY_VERSION) throw string("Unsupported binary model version in "+binfname);
+    if (header.layout<FULL_NODES || header.layout>QUANTIZED_NODES
+            || (header.layout==FULL_NODES && header.node_size!=sizeof(Node))
+            || (header.layout==FLOAT_NODES && header.node_size!=sizeof(FloatNode))
+            || (header.layout==QUANTIZED_NODES && header.node_size!=sizeof(QuantizedNode)))
+        throw string("Incompatible binary model "+binfname);
+    const int64_t max_index = numeric_limits<int>::max();
+    if (header.max_order<1
+            || header.num_nodes<1 || header.num_nodes>=max_index
+            || header.num_arcs<0 || header.num_arcs>max_index
+            || header.num_vocabulary<1 || header.num_vocabulary>max_index
+            || header.root_node<0 || header.root_node>=header.num_nodes
+            || header.sentence_start_node<0 || header.sentence_start_node>=header.num_nodes
+            || header.sentence_start_symbol_idx<0 || header.sentence_start_symbol_idx>=header.num_vocabulary
+            || header.sentence_end_symbol_idx<0 || header.sentence_end_symbol_idx>=header.num_vocabulary
+            || header.unk_symbol_idx<0 || header.unk_symbol_idx>=header.num_vocabulary)
+        throw format_error;
+
+    layout = static_cast<NodeLayout>(header.layout);
+
+    max_order = header.max_order;
+    root_node = header.root_node;
+    sentence_start_node = header.sentence_start_node;
+    sentence_start_symbol_idx = header.sentence_start_symbol_idx;
+    sentence_end_symbol_idx = header.sentence_end_symbol_idx;
+    unk_symbol_idx = header.unk_symbol_idx;
+
+    const int64_t* counts = reinterpret_cast<const int64_t*>(array_section(max_order, sizeof(int64_t)));
+    ngram_counts_per_order.clear();
+    for (int order = 1; order<=max_order; order++)
+        ngram_counts_per_order[order] = counts[order-1];
+
+    if (layout==FULL_NODES) {
+        nodes.map(reinterpret_cast<Node*>(array_section(header.num_nodes, sizeof(Node))), header.num_nodes);
+        arc_words.map(reinterpret_cast<int*>(array_section(header.num_arcs, sizeof(int))), header.num_arcs);
+        arc_target_nodes.map(reinterpret_cast<int*>(array_section(header.num_arcs, sizeof(int))), header.num_arcs);
+    }
+    else {
+        if (layout==FLOAT_NODES)
+            float_nodes.map(reinterpret_cast<FloatNode*>(array_section(header.num_nodes+1, sizeof(FloatNode))),
+                    header.num_nodes+1);
+        else {
+            int64_t codebook_sizes[2];
+            memcpy(codebook_sizes, section(sizeof(codebook_sizes)), sizeof(codebook_sizes));
+            const float* probs = reinterpret_cast<const float*>(array_section(codebook_sizes[0], sizeof(float)));
+            prob_codebook.assign(probs, probs+codebook_sizes[0]);
+            probs = reinterpret_cast<const float*>(array_section(codebook_sizes[1], sizeof(float)));
+            backoff_codebook.assign(probs, probs+codebook_sizes[1]);
+            quantized_nodes.map(
+                    reinterpret_cast<QuantizedNode*>(array_section(header.num_nodes+1, sizeof(QuantizedNode))),
+                    header.num_nodes+1);
+        }
+        arcs.map(reinterpret_cast<Arc*>(array_section(header.num_arcs, sizeof(Arc))), header.num_arcs);
+    }
+
+    const char* vocab_data = array_section(header.vocabulary_bytes, 1);
+    const char* vocab_end = vocab_data+header.vocabulary_bytes;
+    vocabulary.clear();
+    vocabulary_lookup.clear();
+    vocabulary.reserve(header.num_vocabulary);
+    for (int64_t i = 0; i<header.num_vocabulary; i++) {
+        const char* word_end = static_cast<const char*>(memchr(vocab_data, '\0', vocab_end-vocab_data));
+        if (word_end==nullptr) throw format_error;
+        vocabulary.push_back(string(vocab_data, word_end));
+        vocabulary_lookup[vocabulary.back()] = i;
+        vocab_data = word_end+1;
+    }
+    sentence_start_symbol = vocabulary.at(sentence_start_symbol_idx);
+    sentence_end_symbol = vocabulary.at(sentence_end_symbol_idx);
+    unk_symbol = vocabulary.at(unk_symbol_idx);
+
+    // Converting the log base copies the modified pages
+    if (header.natural_log_probs && !natural_log_probs())
+        multiply_probs(1.0/log(10.0));
+    else if (!header.natural_log_probs && natural_log_probs())
+        multiply_probs(log(10.0));
+
+    build_lookup_tables();
 }
 
 void _getline(SimpleFileInput& sfi, string& line, int& linei)
@@ -91,9 +642,14 @@ void _getline(SimpleFileInput& sfi, string& line, int& linei)
 }
 
 void
-Ngram::write_arpa(string arpafname)
+Ngram::write_arpa(string arpafname) const
 {
+    write_arpa(arpafname, 1.0);
+}
 
+void
+Ngram::write_arpa(string arpafname, double prob_multiplier) const
+{
     SimpleFileOutput arpafile(arpafname);
 
     arpafile << "\n";
@@ -101,34 +657,50 @@ Ngram::write_arpa(string arpafname)
     for (int order = 1; order<=max_order; order++)
         arpafile << "ngram " << order << "=" << ngram_counts_per_order.at(order) << "\n";
 
-    vector<pair<int, vector<string>>>order_nodes, next_order_nodes;
-    order_nodes.push_back(make_pair(root_node, vector<string>()));
-
+    // Depth-first walk for each order, the stack holds the current arc on each level
+    // and the n-gram words are the words of these arcs
+    vector<int> arc_stack;
+    vector<int> last_arc_stack;
     for (int order = 1; order<=max_order; order++) {
         arpafile << "\n";
         arpafile << "\\" << order << "-grams:\n";
-        for (auto cnit = order_nodes.begin(); cnit!=order_nodes.end(); ++cnit) {
-            int curr_node = cnit->first;
-            vector<string>& ctxt = cnit->second;
-            Node& nd = nodes[curr_node];
-            if (nd.first_arc==-1) continue;
-            for (int a = nd.first_arc; a<=nd.last_arc; a++) {
-                int target_node_idx = arc_target_nodes[a];
-                Node& target_nd = nodes[target_node_idx];
-                string word = vocabulary[arc_words[a]];
-                arpafile << target_nd.prob << "\t";
-                for (auto ctxtit = ctxt.begin(); ctxtit!=ctxt.end(); ++ctxtit)
-                    arpafile << *ctxtit << " ";
-                arpafile << word;
-                if (target_nd.backoff_prob!=0.0) arpafile << "\t" << target_nd.backoff_prob;
-                arpafile << "\n";
-                vector<string> new_ctxt(ctxt);
-                new_ctxt.push_back(word);
-                next_order_nodes.push_back(make_pair(target_node_idx, new_ctxt));
+
+        int first_arc, last_arc;
+        node_arcs(root_node, first_arc, last_arc);
+        if (first_arc==-1) continue;
+        arc_stack.assign(1, first_arc);
+        last_arc_stack.assign(1, last_arc);
+
+        while (arc_stack.size()>0) {
+            int arc_idx = arc_stack.back();
+            if (arc_idx>last_arc_stack.back()) {
+                arc_stack.pop_back();
+                last_arc_stack.pop_back();
+                if (arc_stack.size()>0) arc_stack.back()++;
+                continue;
             }
+
+            int target_node_idx = arc_target_node(arc_idx);
+            if ((int) arc_stack.size()<order) {
+                node_arcs(target_node_idx, first_arc, last_arc);
+                if (first_arc==-1)
+                    arc_stack.back()++;
+                else {
+                    arc_stack.push_back(first_arc);
+                    last_arc_stack.push_back(last_arc);
+                }
+                continue;
+            }
+
+            arpafile << node_prob(target_node_idx)*prob_multiplier << "\t";
+            for (int i = 0; i<order-1; i++)
+                arpafile << vocabulary[arc_word(arc_stack[i])] << " ";
+            arpafile << vocabulary[arc_word(arc_idx)];
+            double backoff_prob = node_backoff_prob(target_node_idx);
+            if (backoff_prob!=0.0) arpafile << "\t" << backoff_prob*prob_multiplier;
+            arpafile << "\n";
+            arc_stack.back()++;
         }
-        order_nodes.swap(next_order_nodes);
-        next_order_nodes.clear();
     }
 
     arpafile << "\n\\end\\\n";
@@ -140,6 +712,10 @@ Ngram::read_arpa(string arpafname)
 
     SimpleFileInput arpafile(arpafname);
     string header_error("Invalid ARPA header");
+    root_arc_targets.clear();
+    node_arc_hash_tables.clear();
+    arc_hash_tables.clear();
+    arc_hash_slots.clear();
 
     int linei = 0;
     string line;
@@ -169,7 +745,6 @@ Ngram::read_arpa(string arpafname)
     }
 
     int max_ngram_order = curr_ngram_order-1;
-    int total_ngrams_read = 0;
     curr_ngram_order = 1;
     nodes.resize(total_ngram_count+1);
     arc_words.resize(total_ngram_count);
@@ -186,23 +761,126 @@ Ngram::read_arpa(string arpafname)
             throw header_error;
         }
 
-        _getline(arpafile, line, linei);
-        vector<NgramInfo> order_ngrams;
-        int ngrams_read = read_arpa_read_order(arpafile, order_ngrams, line, curr_ngram_order, linei);
+        int ngram_count = ngram_counts_per_order[curr_ngram_order];
+        vector<int> ngram_words;
+        vector<double> ngram_probs, ngram_backoff_probs;
+        int ngrams_read = read_arpa_read_order(arpafile, curr_ngram_order, ngram_count,
+                ngram_words, ngram_probs, ngram_backoff_probs);
 
         cerr << "n-grams for order " << curr_ngram_order << ": " << ngrams_read << endl;
-        if (ngrams_read!=ngram_counts_per_order[curr_ngram_order])
-            throw string("Invalid number of n-grams for order: "+curr_ngram_order);
+        if (ngrams_read!=ngram_count)
+            throw string("Invalid number of n-grams for order: "+to_string(curr_ngram_order));
 
-        sort(order_ngrams.begin(), order_ngrams.end());
-
-        read_arpa_insert_order_to_tree(order_ngrams, curr_node_idx, curr_arc_idx, curr_ngram_order);
+        read_arpa_insert_order_to_tree(curr_ngram_order, ngram_count,
+                ngram_words, ngram_probs, ngram_backoff_probs,
+                curr_node_idx, curr_arc_idx);
 
         max_order = curr_ngram_order;
         curr_ngram_order++;
-        total_ngrams_read += ngrams_read;
+        line.clear();
+    }
+
+    set_special_symbols();
+    build_lookup_tables();
+}
+
+// Runs func(start, end) over equal ranges of [0, count) in parallel,
+// exceptions thrown in the workers are passed to the caller
+template<typename Func>
+void
+parallel_for(size_t count,
+        unsigned int num_threads,
+        Func func)
+{
+    num_threads = max(1UL, min((size_t) num_threads, count/1024));
+    if (num_threads==1) {
+        func((size_t) 0, count);
+        return;
+    }
+
+    vector<string> errors(num_threads);
+    vector<std::thread> workers;
+    for (unsigned int t = 0; t<num_threads; t++) {
+        size_t start = count*t/num_threads;
+        size_t end = count*(t+1)/num_threads;
+        workers.push_back(std::thread([&func, &errors, t, start, end] {
+            try {
+                func(start, end);
+            }
+            catch (string& e) {
+                errors[t] = e;
+            }
+        }));
     }
+    for (auto wit = workers.begin(); wit!=workers.end(); ++wit)
+        wit->join();
+    for (auto eit = errors.begin(); eit!=errors.end(); ++eit)
+        if (eit->length()>0) throw *eit;
+}
 
+// Sorts chunks in parallel and merges them pairwise
+template<typename T>
+void
+parallel_sort(vector<T>& values,
+        unsigned int num_threads)
+{
+    size_t num_chunks = max(1UL, min((size_t) num_threads, values.size()/65536));
+    vector<size_t> bounds;
+    for (size_t c = 0; c<=num_chunks; c++)
+        bounds.push_back(values.size()*c/num_chunks);
+
+    parallel_for(num_chunks, num_chunks, [&](size_t start, size_t end) {
+        for (size_t c = start; c<end; c++)
+            sort(values.begin()+bounds[c], values.begin()+bounds[c+1]);
+    });
+
+    while (bounds.size()>2) {
+        size_t num_merges = (bounds.size()-1)/2;
+        parallel_for(num_merges, num_merges, [&](size_t start, size_t end) {
+            for (size_t m = start; m<end; m++)
+                inplace_merge(values.begin()+bounds[2*m],
+                        values.begin()+bounds[2*m+1],
+                        values.begin()+bounds[2*m+2]);
+        });
+        vector<size_t> merged_bounds;
+        for (size_t b = 0; b<bounds.size(); b += 2)
+            merged_bounds.push_back(bounds[b]);
+        if (merged_bounds.back()!=bounds.back()) merged_bounds.push_back(bounds.back());
+        bounds.swap(merged_bounds);
+    }
+}
+
+inline bool
+is_arpa_space(char c)
+{
+    return c==' ' || c=='\t' || c=='\n' || c=='\r';
+}
+
+inline string_view
+next_arpa_field(string_view& line)
+{
+    size_t start = 0;
+    while (start<line.length() && is_arpa_space(line[start])) start++;
+    size_t end = start;
+    while (end<line.length() && !is_arpa_space(line[end])) end++;
+    string_view field = line.substr(start, end-start);
+    line.remove_prefix(end);
+    return field;
+}
+
+inline double
+parse_arpa_prob(string_view field, const string& line)
+{
+    double prob;
+    from_chars_result res = from_chars(field.data(), field.data()+field.length(), prob);
+    if (field.length()==0 || res.ec!=errc() || res.ptr!=field.data()+field.length())
+        throw string("Problem reading line: "+line);
+    return prob;
+}
+
+void
+Ngram::set_special_symbols()
+{
     if (vocabulary_lookup.find(sentence_start_symbol)==vocabulary_lookup.end())
         throw string("Sentence start symbol not found.");
     sentence_start_symbol_idx = vocabulary_lookup[sentence_start_symbol];
@@ -227,109 +905,244 @@ Ngram::read_arpa(string arpafname)
         unk_symbol_idx = vocabulary_lookup["<UNK>"];
     }
     else throw string("Error, no unk symbol in the language model");
+
+}
+
+void
+Ngram::build_model(const vector<string>& words,
+        const vector<vector<int>>& ngram_words,
+        const vector<vector<double>>& ngram_probs,
+        const vector<vector<double>>& ngram_backoff_probs)
+{
+    if (ngram_probs.size()==0 || ngram_probs[0].size()!=words.size())
+        throw string("Unigrams should list the vocabulary");
+
+    root_arc_targets.clear();
+    node_arc_hash_tables.clear();
+    arc_hash_tables.clear();
+    arc_hash_slots.clear();
+    layout = FULL_NODES;
+    model_file.reset();
+
+    vocabulary = words;
+    vocabulary_lookup.clear();
+    for (int i = 0; i<(int) vocabulary.size(); i++)
+        if (!vocabulary_lookup.insert(make_pair(vocabulary[i], i)).second)
+            throw string("Duplicate n-gram in model");
+
+    ngram_counts_per_order.clear();
+    int total_ngram_count = 0;
+    for (int order = 1; order<=(int) ngram_probs.size(); order++) {
+        ngram_counts_per_order[order] = ngram_probs[order-1].size();
+        total_ngram_count += ngram_probs[order-1].size();
+    }
+    nodes.resize(0);
+    nodes.resize(total_ngram_count+1);
+    arc_words.resize(total_ngram_count);
+    arc_target_nodes.resize(total_ngram_count);
+
+    int curr_node_idx = 1;
+    int curr_arc_idx = 0;
+    for (int order = 1; order<=(int) ngram_probs.size(); order++) {
+        read_arpa_insert_order_to_tree(order, ngram_probs[order-1].size(),
+                ngram_words[order-1], ngram_probs[order-1], ngram_backoff_probs[order-1],
+                curr_node_idx, curr_arc_idx);
+        max_order = order;
+    }
+
+    set_special_symbols();
+    build_lookup_tables();
 }
 
 int
 Ngram::read_arpa_read_order(SimpleFileInput& arpafile,
-        vector<NgramInfo>& order_ngrams,
-        string& line,
         int curr_ngram_order,
-        int& linei)
+        int ngram_count,
+        vector<int>& ngram_words,
+        vector<double>& ngram_probs,
+        vector<double>& ngram_backoff_probs)
 {
-    int ngrams_read = 0;
+    unsigned int num_threads = num_read_threads>0 ? num_read_threads
+                                                  : max(1U, std::thread::hardware_concurrency());
+    ngram_words.resize((size_t) ngram_count*curr_ngram_order);
+    ngram_probs.resize(ngram_count);
+    ngram_backoff_probs.resize(ngram_count);
+    if (curr_ngram_order==1) vocabulary.resize(ngram_count);
 
-    while (line.length()>0) {
-        stringstream vals(line);
+    // Word indices for the higher orders, the views point to the vocabulary
+    unordered_map<string_view, int> word_lookup;
+    if (curr_ngram_order>1) {
+        word_lookup.reserve(vocabulary.size());
+        for (int i = 0; i<(int) vocabulary.size(); i++)
+            word_lookup[vocabulary[i]] = i;
+    }
 
-        NgramInfo ngram;
-        vals >> ngram.prob;
-        if (ngram.prob>0.0) {
-            throw string("Invalid log probability "+line);
+    // Lines are collected to batches which are parsed in parallel
+    const size_t batch_lines = 1048576;
+    string batch;
+    vector<size_t> line_starts;
+    int ngrams_read = 0;
+    bool section_end = false;
+    while (!section_end) {
+        batch.clear();
+        line_starts.clear();
+        string_view line;
+        while (line_starts.size()<batch_lines) {
+            if (!arpafile.getline(line)) throw string("Problem reading ARPA file");
+            size_t start = 0;
+            while (start<line.length() && is_arpa_space(line[start])) start++;
+            if (start==line.length()) {
+                section_end = true;
+                break;
+            }
+            line_starts.push_back(batch.length());
+            batch.append(line.data(), line.length());
         }
+        line_starts.push_back(batch.length());
 
-        vector<string> curr_ngram_str;
-        string tmp;
-        for (int i = 0; i<curr_ngram_order; i++) {
-            if (vals.eof()) throw string("Problem reading line: "+line);
-            vals >> tmp;
-            curr_ngram_str.push_back(tmp);
-        }
-        if (curr_ngram_order==1) {
-            vocabulary.push_back(curr_ngram_str[0]);
-            vocabulary_lookup[curr_ngram_str[0]] = vocabulary.size()-1;
-        }
+        int num_lines = line_starts.size()-1;
+        if (ngrams_read+num_lines>ngram_count)
+            throw string("Invalid number of n-grams for order: "+to_string(curr_ngram_order));
 
-        vector<int> curr_ngram_words;
-        for (auto sit = curr_ngram_str.begin(); sit!=curr_ngram_str.end(); ++sit)
-            curr_ngram_words.push_back(vocabulary_lookup[*sit]);
-        ngram.ngram = curr_ngram_words;
+        parallel_for(num_lines, num_threads, [&](size_t start, size_t end) {
+            for (size_t l = start; l<end; l++) {
+                string_view line(batch.data()+line_starts[l], line_starts[l+1]-line_starts[l]);
+                string_view fields(line);
+                size_t ngram_idx = ngrams_read+l;
 
-        if (!vals.eof())
-            vals >> ngram.backoff_prob;
-        if (vals.fail()) throw string("Problem reading line: "+line);
+                double prob = parse_arpa_prob(next_arpa_field(fields), string(line));
+                if (prob>0.0) throw string("Invalid log probability "+string(line));
+                ngram_probs[ngram_idx] = prob;
 
-        order_ngrams.push_back(ngram);
-        _getline(arpafile, line, linei);
-        ngrams_read++;
+                int* words = &ngram_words[ngram_idx*curr_ngram_order];
+                for (int i = 0; i<curr_ngram_order; i++) {
+                    string_view word = next_arpa_field(fields);
+                    if (word.length()==0) throw string("Problem reading line: "+string(line));
+                    if (curr_ngram_order==1) {
+                        vocabulary[ngram_idx].assign(word.data(), word.length());
+                        words[i] = ngram_idx;
+                    }
+                    else {
+                        auto wit = word_lookup.find(word);
+                        if (wit==word_lookup.end())
+                            throw string("Unknown word in line: "+string(line));
+                        words[i] = wit->second;
+                    }
+                }
+
+                string_view backoff = next_arpa_field(fields);
+                ngram_backoff_probs[ngram_idx] =
+                        backoff.length()>0 ? parse_arpa_prob(backoff, string(line)) : 0.0;
+                if (next_arpa_field(fields).length()>0)
+                    throw string("Problem reading line: "+string(line));
+            }
+        });
+
+        ngrams_read += num_lines;
+    }
+
+    if (curr_ngram_order==1) {
+        vocabulary.resize(ngrams_read);
+        for (int i = 0; i<(int) vocabulary.size(); i++)
+            if (!vocabulary_lookup.insert(make_pair(vocabulary[i], i)).second)
+                throw string("Duplicate n-gram in model");
     }
 
     return ngrams_read;
 }
 
 void
-Ngram::read_arpa_insert_order_to_tree(std::vector<NgramInfo>& order_ngrams,
+Ngram::read_arpa_insert_order_to_tree(int curr_order,
+        int ngram_count,
+        const vector<int>& ngram_words,
+        const vector<double>& ngram_probs,
+        const vector<double>& ngram_backoff_probs,
         int& curr_node_idx,
-        int& curr_arc_idx,
-        int curr_order)
+        int& curr_arc_idx)
 {
-    for (unsigned int ni = 0; ni<order_ngrams.size(); ni++) {
+    unsigned int num_threads = num_read_threads>0 ? num_read_threads
+                                                  : max(1U, std::thread::hardware_concurrency());
 
-        int node_idx_traversal = root_node;
-        for (unsigned int i = 0; i<order_ngrams[ni].ngram.size()-1; i++) {
-            node_idx_traversal = find_node(node_idx_traversal, order_ngrams[ni].ngram[i]);
-            if (node_idx_traversal==-1) throw string("Missing lower order n-gram");
+    // Find the context nodes, they only have arcs from the lower orders.
+    // Context nodes are numbered in sorted order, so sorting by
+    // (context node, word) gives the n-grams in sorted order.
+    vector<pair<uint64_t, int>> sorted_ngrams(ngram_count);
+    parallel_for(ngram_count, num_threads, [&](size_t start, size_t end) {
+        for (size_t ni = start; ni<end; ni++) {
+            const int* words = &ngram_words[ni*curr_order];
+            int node_idx_traversal = root_node;
+            for (int i = 0; i<curr_order-1; i++) {
+                node_idx_traversal = find_node(node_idx_traversal, words[i]);
+                if (node_idx_traversal==-1) throw string("Missing lower order n-gram");
+            }
+            uint64_t key = ((uint64_t) node_idx_traversal << 32) | (uint64_t) words[curr_order-1];
+            sorted_ngrams[ni] = make_pair(key, (int) ni);
         }
-        int tmp = find_node(node_idx_traversal, order_ngrams[ni].ngram.back());
-        if (tmp!=-1)
-            throw string("Duplicate n-gram in model");
+    });
+    parallel_sort(sorted_ngrams, num_threads);
 
-        if (nodes[node_idx_traversal].first_arc==-1)
-            nodes[node_idx_traversal].first_arc = curr_arc_idx;
-        nodes[node_idx_traversal].last_arc = curr_arc_idx;
+    int first_node_idx = curr_node_idx;
+    int first_arc_idx = curr_arc_idx;
+    parallel_for(ngram_count, num_threads, [&](size_t start, size_t end) {
+        for (size_t pos = start; pos<end; pos++) {
+            uint64_t key = sorted_ngrams[pos].first;
+            if (pos>0 && key==sorted_ngrams[pos-1].first)
+                throw string("Duplicate n-gram in model");
 
-        arc_words[curr_arc_idx] = order_ngrams[ni].ngram.back();
-        arc_target_nodes[curr_arc_idx] = curr_node_idx;
-        nodes[curr_node_idx].prob = order_ngrams[ni].prob;
-        nodes[curr_node_idx].backoff_prob = order_ngrams[ni].backoff_prob;
+            int ni = sorted_ngrams[pos].second;
+            const int* words = &ngram_words[(size_t) ni*curr_order];
+            int context_node = key >> 32;
+            int arc_idx = first_arc_idx+pos;
+            int node_idx = first_node_idx+pos;
 
-        int ctxt_start = 1;
-        while (true) {
-            int bo_traversal = root_node;
-            unsigned int i = ctxt_start;
-            for (; i<order_ngrams[ni].ngram.size(); i++) {
-                int tmp = find_node(bo_traversal, order_ngrams[ni].ngram[i]);
-                if (tmp==-1) break;
-                bo_traversal = tmp;
-            }
-            if (i>=order_ngrams[ni].ngram.size()) {
-                nodes[curr_node_idx].backoff_node = bo_traversal;
-                break;
+            if (pos==0 || (int) (sorted_ngrams[pos-1].first >> 32)!=context_node)
+                nodes[context_node].first_arc = arc_idx;
+            if (pos==(size_t) ngram_count-1 || (int) (sorted_ngrams[pos+1].first >> 32)!=context_node)
+                nodes[context_node].last_arc = arc_idx;
+
+            arc_words[arc_idx] = words[curr_order-1];
+            arc_target_nodes[arc_idx] = node_idx;
+            nodes[node_idx].prob = ngram_probs[ni];
+            nodes[node_idx].backoff_prob = ngram_backoff_probs[ni];
+
+            // Longest suffix, only arcs from the lower orders are traversed
+            int ctxt_start = 1;
+            while (true) {
+                int bo_traversal = root_node;
+                int i = ctxt_start;
+                for (; i<curr_order; i++) {
+                    int tmp = find_node(bo_traversal, words[i]);
+                    if (tmp==-1) break;
+                    bo_traversal = tmp;
+                }
+                if (i>=curr_order) {
+                    nodes[node_idx].backoff_node = bo_traversal;
+                    break;
+                }
+                else ctxt_start++;
             }
-            else ctxt_start++;
         }
+    });
 
-        curr_arc_idx++;
-        curr_node_idx++;
-    }
+    curr_node_idx += ngram_count;
+    curr_arc_idx += ngram_count;
 }
 
 void
-LNNgram::multiply_probs(double multiplier)
+Ngram::multiply_probs(double multiplier)
 {
     for (unsigned int i = 0; i<nodes.size(); i++) {
         nodes[i].prob *= multiplier;
         nodes[i].backoff_prob *= multiplier;
     }
+    for (unsigned int i = 0; i<float_nodes.size(); i++) {
+        float_nodes[i].prob *= multiplier;
+        float_nodes[i].backoff_prob *= multiplier;
+    }
+    for (auto pit = prob_codebook.begin(); pit!=prob_codebook.end(); ++pit)
+        *pit *= multiplier;
+    for (auto pit = backoff_codebook.begin(); pit!=backoff_codebook.end(); ++pit)
+        *pit *= multiplier;
 }
 
 void
@@ -340,9 +1153,169 @@ LNNgram::read_arpa(string arpafname)
 }
 
 void
-LNNgram::write_arpa(string arpafname)
+LNNgram::write_arpa(string arpafname) const
 {
-    multiply_probs(1.0/log(10.0));
-    Ngram::write_arpa(arpafname);
-    multiply_probs(log(10.0));
+    Ngram::write_arpa(arpafname, 1.0/log(10.0));
+}
+
+
+static const unsigned long long EMPTY_SLOT = ~0ULL;
+
+static inline unsigned long long
+score_cache_key(int node_idx, int word)
+{
+    return ((unsigned long long) node_idx << 32) | (unsigned int) word;
+}
+
+ScoreCache::ScoreCache(const Ngram& ngram, int size_bits)
+        :m_ngram(ngram),
+         m_shift(64-size_bits),
+         m_counters(new Counters[NUM_COUNTERS])
+{
+    if (size_bits<1 || size_bits>32)
+        throw string("Invalid score cache size");
+    m_slots.reset(new Slot[1ULL << size_bits]);
+    for (unsigned long long i = 0; i<(1ULL << size_bits); i++) {
+        m_slots[i].sequence.store(0, memory_order_relaxed);
+        m_slots[i].key.store(EMPTY_SLOT, memory_order_relaxed);
+    }
+    for (int i = 0; i<NUM_COUNTERS; i++) {
+        m_counters[i].hits.store(0, memory_order_relaxed);
+        m_counters[i].misses.store(0, memory_order_relaxed);
+    }
+}
+
+ScoreCache::Counters&
+ScoreCache::thread_counters()
+{
+    static atomic<unsigned int> num_threads(0);
+    static thread_local unsigned int thread_idx = num_threads.fetch_add(1, memory_order_relaxed);
+    return m_counters[thread_idx%NUM_COUNTERS];
+}
+
+unsigned long int
+ScoreCache::hits() const
+{
+    unsigned long int hits = 0;
+    for (int i = 0; i<NUM_COUNTERS; i++)
+        hits += m_counters[i].hits.load(memory_order_relaxed);
+    return hits;
+}
+
+unsigned long int
+ScoreCache::misses() const
+{
+    unsigned long int misses = 0;
+    for (int i = 0; i<NUM_COUNTERS; i++)
+        misses += m_counters[i].misses.load(memory_order_relaxed);
+    return misses;
+}
+
+bool
+ScoreCache::lookup(int node_idx, int word, double& score, int& next_node)
+{
+    unsigned long long key = score_cache_key(node_idx, word);
+    Slot& s = slot(key);
+    Counters& counters = thread_counters();
+    unsigned int sequence = s.sequence.load(memory_order_acquire);
+    if ((sequence & 1) || s.key.load(memory_order_relaxed)!=key) {
+        counters.misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    score = s.score.load(memory_order_relaxed);
+    next_node = s.next_node.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    // The slot may have been rewritten while reading
+    if (s.sequence.load(memory_order_relaxed)!=sequence) {
+        counters.misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    counters.hits.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+void
+ScoreCache::insert(int node_idx, int word, double score, int next_node)
+{
+    unsigned long long key = score_cache_key(node_idx, word);
+    Slot& s = slot(key);
+    unsigned int sequence = s.sequence.load(memory_order_relaxed);
+    if ((sequence & 1)
+            || !s.sequence.compare_exchange_strong(sequence, sequence+1, memory_order_acquire))
+        return;
+    atomic_thread_fence(memory_order_release);
+    s.key.store(key, memory_order_relaxed);
+    s.score.store(score, memory_order_relaxed);
+    s.next_node.store(next_node, memory_order_relaxed);
+    s.sequence.store(sequence+2, memory_order_release);
+}
+
+int
+ScoreCache::score(int node_idx, int word, double& score)
+{
+    double tmp_score;
+    int next_node;
+    if (!lookup(node_idx, word, tmp_score, next_node)) {
+        tmp_score = 0.0;
+        next_node = m_ngram.score(node_idx, word, tmp_score);
+        insert(node_idx, word, tmp_score, next_node);
+    }
+    score += tmp_score;
+    return next_node;
+}
+
+void
+ScoreCache::score(int node_idx,
+        const vector<int>& words,
+        vector<double>& scores,
+        vector<int>& next_nodes)
+{
+    scores.resize(words.size());
+    next_nodes.resize(words.size());
+
+    static thread_local vector<int> miss_idxs, miss_words, miss_next_nodes;
+    static thread_local vector<double> miss_scores;
+    miss_idxs.clear();
+    miss_words.clear();
+    for (unsigned int i = 0; i<words.size(); i++) {
+        if (lookup(node_idx, words[i], scores[i], next_nodes[i])) continue;
+        miss_idxs.push_back(i);
+        miss_words.push_back(words[i]);
+    }
+    if (miss_idxs.size()==0) return;
+
+    m_ngram.score(node_idx, miss_words, miss_scores, miss_next_nodes);
+    for (unsigned int i = 0; i<miss_idxs.size(); i++) {
+        scores[miss_idxs[i]] = miss_scores[i];
+        next_nodes[miss_idxs[i]] = miss_next_nodes[i];
+        insert(node_idx, miss_words[i], miss_scores[i], miss_next_nodes[i]);
+    }
+}
+
+void
+ScoreCache::score(const vector<int>& node_idxs,
+        int word,
+        vector<double>& scores,
+        vector<int>& next_nodes)
+{
+    scores.resize(node_idxs.size());
+    next_nodes.resize(node_idxs.size());
+
+    static thread_local vector<int> miss_idxs, miss_nodes, miss_next_nodes;
+    static thread_local vector<double> miss_scores;
+    miss_idxs.clear();
+    miss_nodes.clear();
+    for (unsigned int i = 0; i<node_idxs.size(); i++) {
+        if (lookup(node_idxs[i], word, scores[i], next_nodes[i])) continue;
+        miss_idxs.push_back(i);
+        miss_nodes.push_back(node_idxs[i]);
+    }
+    if (miss_idxs.size()==0) return;
+
+    m_ngram.score(miss_nodes, word, miss_scores, miss_next_nodes);
+    for (unsigned int i = 0; i<miss_idxs.size(); i++) {
+        scores[miss_idxs[i]] = miss_scores[i];
+        next_nodes[miss_idxs[i]] = miss_next_nodes[i];
+        insert(miss_nodes[i], word, miss_scores[i], miss_next_nodes[i]);
+    }
 }
@@ -1,12 +1,56 @@
 #ifndef NGRAM_HH
 #define NGRAM_HH
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "io.hh"
 
+// Array which either owns its elements or points to a memory mapped model file
+template<typename T>
+class NgramArray {
+public:
+    NgramArray() :m_data(nullptr), m_size(0) { };
+    NgramArray(const NgramArray& arr) { *this = arr; };
+    NgramArray& operator=(const NgramArray& arr)
+    {
+        m_owned = arr.m_owned;
+        m_size = arr.m_size;
+        m_data = arr.owned() ? m_owned.data() : arr.m_data;
+        return *this;
+    }
+    void resize(size_t size)
+    {
+        m_owned.resize(size);
+        m_data = m_owned.data();
+        m_size = size;
+    }
+    void map(T* data, size_t size)
+    {
+        std::vector<T>().swap(m_owned);
+        m_data = data;
+        m_size = size;
+    }
+    bool owned() const { return m_data==m_owned.data(); }
+    size_t size() const { return m_size; }
+    T* data() { return m_data; }
+    const T* data() const { return m_data; }
+    T* begin() { return m_data; }
+    T* end() { return m_data+m_size; }
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data+m_size; }
+    T& operator[](size_t i) { return m_data[i]; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+private:
+    std::vector<T> m_owned;
+    T* m_data;
+    size_t m_size;
+};
+
 class Ngram {
 public:
 
@@ -22,6 +66,33 @@ public:
         int last_arc;
     };
 
+    // Compact layouts, arcs of node n are [first_arc of n, first_arc of n+1)
+    enum NodeLayout { FULL_NODES = 0, FLOAT_NODES = 1, QUANTIZED_NODES = 2 };
+
+    class FloatNode {
+    public:
+        float prob;
+        float backoff_prob;
+        int backoff_node;
+        int first_arc;
+    };
+
+    // Probabilities are 16-bit indices to the codebooks, narrower indices
+    // would not make the node smaller because of the int alignment
+    class QuantizedNode {
+    public:
+        int backoff_node;
+        int first_arc;
+        unsigned short int prob;
+        unsigned short int backoff_prob;
+    };
+
+    class Arc {
+    public:
+        int word;
+        int target_node;
+    };
+
     Ngram()
             :root_node(0),
              sentence_start_node(-1),
@@ -31,18 +102,67 @@ public:
              sentence_end_symbol("</s>"),
              unk_symbol_idx(-1),
              unk_symbol("<unk>"),
-             max_order(-1) { };
+             max_order(-1),
+             num_read_threads(0),
+             layout(FULL_NODES),
+             hash_fanout_threshold(64) { };
     ~Ngram() { };
+    // Reads either an ARPA or a binary model
+    void read_model(std::string modelfname);
     virtual void read_arpa(std::string arpafname);
-    virtual void write_arpa(std::string arpafname);
+    virtual void write_arpa(std::string arpafname) const;
+    // Writes the model without modifying it, the probabilities are multiplied on the fly
+    void write_arpa(std::string arpafname, double prob_multiplier) const;
+    // Builds the model from the n-grams of each order, the n-gram words are vocabulary
+    // indices and the unigrams list the vocabulary in order. The probabilities are
+    // in the log base of the model.
+    void build_model(const std::vector<std::string>& words,
+            const std::vector<std::vector<int>>& ngram_words,
+            const std::vector<std::vector<double>>& ngram_probs,
+            const std::vector<std::vector<double>>& ngram_backoff_probs);
+    // Binary models are memory mapped, the mapped pages are shared between processes
+    void read_binary(std::string binfname);
+    void write_binary(std::string binfname);
+    static bool is_binary_model(std::string modelfname);
+    virtual bool natural_log_probs() const { return false; }
+    void multiply_probs(double multiplier);
+    // Converts to float probabilities (bits=32) or 16-bit quantised probabilities (bits=16)
+    void compact(int bits = 32);
+    // Direct index for the root arcs and hash tables for nodes with many arcs,
+    // built when a model is read
+    void build_lookup_tables();
     int score(int node_idx, int word, double& score) const;
     int score(int node_idx, int word, float& score) const;
-    int advance(int node_idx, int word) const
-    {
-        float tmp;
-        return score(node_idx, word, tmp);
-    }
+    int advance(int node_idx, int word) const;
+    // Scores several words from one context, the backoff chain is traversed once.
+    // The log probabilities and resulting nodes are written to the output vectors.
+    void score(int node_idx,
+            const std::vector<int>& words,
+            std::vector<double>& scores,
+            std::vector<int>& next_nodes) const;
+    // Resulting nodes of several words from one context without the probabilities
+    void advance(int node_idx,
+            const std::vector<int>& words,
+            std::vector<int>& next_nodes) const;
+    // Scores one word from several contexts, shared backoff nodes are scored once
+    void score(const std::vector<int>& node_idxs,
+            int word,
+            std::vector<double>& scores,
+            std::vector<int>& next_nodes) const;
     int order() { return max_order; };
+    int num_nodes() const;
+    // Accessors for the current layout, the templated versions are for a known layout
+    double node_prob(int node_idx) const;
+    double node_backoff_prob(int node_idx) const;
+    int node_backoff_node(int node_idx) const;
+    // Arcs of a node are [first_arc, last_arc], first_arc is -1 for nodes without arcs
+    void node_arcs(int node_idx, int& first_arc, int& last_arc) const;
+    int arc_word(int arc_idx) const;
+    int arc_target_node(int arc_idx) const;
+    template<NodeLayout L> double node_prob(int node_idx) const;
+    template<NodeLayout L> double node_backoff_prob(int node_idx) const;
+    template<NodeLayout L> int node_backoff_node(int node_idx) const;
+    template<NodeLayout L> void node_arcs(int node_idx, int& first_arc, int& last_arc) const;
     void get_reverse_bigrams(std::map<int, std::vector<int> >& reverse_bigrams);
 
     int root_node;
@@ -62,47 +182,228 @@ public:
 
 //private:
 
-    class NgramInfo {
-    public:
-        NgramInfo()
-                :prob(0.0), backoff_prob(0.0) { }
-        std::vector<int> ngram;
-        double prob;
-        double backoff_prob;
-        bool operator<(const NgramInfo& ngri) const
-        {
-            if (ngram.size()!=ngri.ngram.size())
-                throw std::string("Comparing ngrams of different order");
-            for (unsigned int i = 0; i<ngram.size(); i++)
-                if (ngram[i]<ngri.ngram[i]) return true;
-                else if (ngri.ngram[i]<ngram[i]) return false;
-            throw std::string("Comparing same ngrams");
-        }
-    };
-
+    void set_special_symbols();
     int find_node(int node_idx, int word) const;
+    template<NodeLayout L> int find_node(int node_idx, int word) const;
+    // The node itself if it has arcs, otherwise its backoff node
+    int context_node(int node_idx) const
+    {
+        int first_arc, last_arc;
+        node_arcs(node_idx, first_arc, last_arc);
+        return first_arc==-1 ? node_backoff_node(node_idx) : node_idx;
+    }
+    template<NodeLayout L> int context_node(int node_idx) const
+    {
+        int first_arc, last_arc;
+        node_arcs<L>(node_idx, first_arc, last_arc);
+        return first_arc==-1 ? node_backoff_node<L>(node_idx) : node_idx;
+    }
+    // Scoring kernel, T is the accumulator type and without PROBS only the
+    // resulting node is computed. MAX_ORDER bounds the backoff loop, 0 for any order.
+    template<typename T, bool PROBS, NodeLayout L, int MAX_ORDER>
+    int score_kernel(int node_idx, int word, T& score) const;
+    template<typename T, bool PROBS> int score_dispatch(int node_idx, int word, T& score) const;
+    template<typename T, bool PROBS, NodeLayout L> int score_dispatch_order(int node_idx, int word, T& score) const;
+    template<bool PROBS> void score_words(int node_idx,
+            const std::vector<int>& words,
+            std::vector<double>* scores,
+            std::vector<int>& next_nodes) const;
     int read_arpa_read_order(SimpleFileInput& arpafile,
-            std::vector<NgramInfo>& order_ngrams,
-            std::string& line,
             int curr_ngram_order,
-            int& linei);
-    void read_arpa_insert_order_to_tree(std::vector<NgramInfo>& order_ngrams,
+            int ngram_count,
+            std::vector<int>& ngram_words,
+            std::vector<double>& ngram_probs,
+            std::vector<double>& ngram_backoff_probs);
+    void read_arpa_insert_order_to_tree(int curr_order,
+            int ngram_count,
+            const std::vector<int>& ngram_words,
+            const std::vector<double>& ngram_probs,
+            const std::vector<double>& ngram_backoff_probs,
             int& curr_node_idx,
-            int& curr_arc_idx,
-            int curr_order);
+            int& curr_arc_idx);
 
-    std::vector<Node> nodes;
-    std::vector<int> arc_words;
-    std::vector<int> arc_target_nodes;
+    NgramArray<Node> nodes;
+    NgramArray<int> arc_words;
+    NgramArray<int> arc_target_nodes;
     std::map<int, int> ngram_counts_per_order;
     int max_order;
+    // Threads for reading ARPA models, 0 uses all cores
+    unsigned int num_read_threads;
+    std::shared_ptr<MMapFile> model_file;
+
+    NodeLayout layout;
+    NgramArray<FloatNode> float_nodes;
+    NgramArray<QuantizedNode> quantized_nodes;
+    NgramArray<Arc> arcs;
+    std::vector<float> prob_codebook;
+    std::vector<float> backoff_codebook;
+
+    class ArcHashTable {
+    public:
+        size_t offset;
+        unsigned int mask;
+    };
+    int hash_fanout_threshold;
+    std::vector<int> root_arc_targets;
+    // Index of the hash table of each node, -1 for nodes searched from the sorted arcs
+    std::vector<int> node_arc_hash_tables;
+    std::vector<ArcHashTable> arc_hash_tables;
+    std::vector<Arc> arc_hash_slots;
 };
 
+inline int
+Ngram::num_nodes() const
+{
+    if (layout==FLOAT_NODES) return float_nodes.size()-1;
+    else if (layout==QUANTIZED_NODES) return quantized_nodes.size()-1;
+    return nodes.size();
+}
+
+template<Ngram::NodeLayout L>
+inline double
+Ngram::node_prob(int node_idx) const
+{
+    if constexpr (L==FLOAT_NODES) return float_nodes[node_idx].prob;
+    else if constexpr (L==QUANTIZED_NODES) return prob_codebook[quantized_nodes[node_idx].prob];
+    else return nodes[node_idx].prob;
+}
+
+template<Ngram::NodeLayout L>
+inline double
+Ngram::node_backoff_prob(int node_idx) const
+{
+    if constexpr (L==FLOAT_NODES) return float_nodes[node_idx].backoff_prob;
+    else if constexpr (L==QUANTIZED_NODES) return backoff_codebook[quantized_nodes[node_idx].backoff_prob];
+    else return nodes[node_idx].backoff_prob;
+}
+
+template<Ngram::NodeLayout L>
+inline int
+Ngram::node_backoff_node(int node_idx) const
+{
+    if constexpr (L==FLOAT_NODES) return float_nodes[node_idx].backoff_node;
+    else if constexpr (L==QUANTIZED_NODES) return quantized_nodes[node_idx].backoff_node;
+    else return nodes[node_idx].backoff_node;
+}
+
+template<Ngram::NodeLayout L>
+inline void
+Ngram::node_arcs(int node_idx, int& first_arc, int& last_arc) const
+{
+    if constexpr (L==FULL_NODES) {
+        first_arc = nodes[node_idx].first_arc;
+        last_arc = nodes[node_idx].last_arc;
+        return;
+    }
+    else if constexpr (L==FLOAT_NODES) {
+        first_arc = float_nodes[node_idx].first_arc;
+        last_arc = float_nodes[node_idx+1].first_arc-1;
+    }
+    else {
+        first_arc = quantized_nodes[node_idx].first_arc;
+        last_arc = quantized_nodes[node_idx+1].first_arc-1;
+    }
+    if (last_arc<first_arc) first_arc = last_arc = -1;
+}
+
+inline double
+Ngram::node_prob(int node_idx) const
+{
+    if (layout==FLOAT_NODES) return node_prob<FLOAT_NODES>(node_idx);
+    else if (layout==QUANTIZED_NODES) return node_prob<QUANTIZED_NODES>(node_idx);
+    return node_prob<FULL_NODES>(node_idx);
+}
+
+inline double
+Ngram::node_backoff_prob(int node_idx) const
+{
+    if (layout==FLOAT_NODES) return node_backoff_prob<FLOAT_NODES>(node_idx);
+    else if (layout==QUANTIZED_NODES) return node_backoff_prob<QUANTIZED_NODES>(node_idx);
+    return node_backoff_prob<FULL_NODES>(node_idx);
+}
+
+inline int
+Ngram::node_backoff_node(int node_idx) const
+{
+    if (layout==FLOAT_NODES) return node_backoff_node<FLOAT_NODES>(node_idx);
+    else if (layout==QUANTIZED_NODES) return node_backoff_node<QUANTIZED_NODES>(node_idx);
+    return node_backoff_node<FULL_NODES>(node_idx);
+}
+
+inline void
+Ngram::node_arcs(int node_idx, int& first_arc, int& last_arc) const
+{
+    if (layout==FLOAT_NODES) node_arcs<FLOAT_NODES>(node_idx, first_arc, last_arc);
+    else if (layout==QUANTIZED_NODES) node_arcs<QUANTIZED_NODES>(node_idx, first_arc, last_arc);
+    else node_arcs<FULL_NODES>(node_idx, first_arc, last_arc);
+}
+
+inline int
+Ngram::arc_word(int arc_idx) const
+{
+    if (layout==FULL_NODES) return arc_words[arc_idx];
+    return arcs[arc_idx].word;
+}
+
+inline int
+Ngram::arc_target_node(int arc_idx) const
+{
+    if (layout==FULL_NODES) return arc_target_nodes[arc_idx];
+    return arcs[arc_idx].target_node;
+}
+
 class LNNgram : public Ngram {
 public:
     void read_arpa(std::string arpafname);
-    void write_arpa(std::string arpafname);
-    void multiply_probs(double multiplier);
+    void write_arpa(std::string arpafname) const;
+    bool natural_log_probs() const { return true; }
+};
+
+// Fixed size cache of n-gram scores keyed by context node and word.
+// Lookups are lock-free and the cache may be shared by several threads,
+// an insert is skipped if another thread is writing the same slot.
+// Each slot has a sequence number which is odd while the slot is written
+// and changes with every write, a lookup is a miss if it changed during the read.
+class ScoreCache {
+public:
+    ScoreCache(const Ngram& ngram, int size_bits = 20);
+    int score(int node_idx, int word, double& score);
+    void score(int node_idx,
+            const std::vector<int>& words,
+            std::vector<double>& scores,
+            std::vector<int>& next_nodes);
+    void score(const std::vector<int>& node_idxs,
+            int word,
+            std::vector<double>& scores,
+            std::vector<int>& next_nodes);
+    unsigned long int hits() const;
+    unsigned long int misses() const;
+
+private:
+    struct Slot {
+        std::atomic<unsigned int> sequence;
+        std::atomic<unsigned long long> key;
+        std::atomic<double> score;
+        std::atomic<int> next_node;
+    };
+    // Hit and miss counters on separate cache lines, each thread uses one of them
+    struct alignas(64) Counters {
+        std::atomic<unsigned long int> hits;
+        std::atomic<unsigned long int> misses;
+    };
+    static const int NUM_COUNTERS = 64;
+    Counters& thread_counters();
+    bool lookup(int node_idx, int word, double& score, int& next_node);
+    void insert(int node_idx, int word, double score, int next_node);
+    Slot& slot(unsigned long long key)
+    {
+        return m_slots[(key*0x9E3779B97F4A7C15ULL) >> m_shift];
+    }
+
+    const Ngram& m_ngram;
+    std::unique_ptr<Slot[]> m_slots;
+    int m_shift;
+    std::unique_ptr<Counters[]> m_counters;
 };
 
 #endif
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+#include "NgramEstimation.hh"
+
+using namespace std;
+
+typedef unordered_map<vector<int>, double, ClassNgramCounts::NgramHash> NgramMap;
+
+// Log probability for n-grams which are never predicted, as in SRILM models
+static const double ZERO_LOG_PROB = -99.0*log(10.0);
+
+class ContextStats {
+public:
+    ContextStats() :total(0.0), types(0), n1(0), n2(0), n3(0) { }
+    double total;
+    // Number of words with a nonzero count
+    int types;
+    // Number of words with count 1, 2 and 3 or more, used by Kneser-Ney
+    int n1, n2, n3;
+};
+
+Smoothing
+get_smoothing(string smoothing)
+{
+    if (smoothing=="wb") return WITTEN_BELL;
+    if (smoothing=="kn") return KNESER_NEY;
+    throw string("Unknown smoothing: "+smoothing);
+}
+
+static int
+count_bin(double count)
+{
+    if (count<=0.0) return 0;
+    return min(3L, max(1L, lround(count)));
+}
+
+// Modified Kneser-Ney discounts for counts 1, 2 and 3+ from the count-of-counts.
+// Falls back to a single absolute discount if some count-of-count is zero.
+static void
+kn_discounts(const NgramMap& counts,
+        int sentence_begin,
+        double discounts[4])
+{
+    double n[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    for (auto cit = counts.begin(); cit!=counts.end(); ++cit) {
+        if (cit->first.back()==sentence_begin || cit->second<=0.0) continue;
+        long int count = max(1L, lround(cit->second));
+        if (count<=4) n[count] += 1.0;
+    }
+
+    double y = (n[1]>0.0 && n[2]>0.0) ? n[1]/(n[1]+2.0*n[2]) : 0.5;
+    discounts[0] = 0.0;
+    discounts[1] = 1.0-2.0*y*n[2]/n[1];
+    discounts[2] = 2.0-3.0*y*n[3]/n[2];
+    discounts[3] = 3.0-4.0*y*n[4]/n[3];
+    for (int i = 1; i<=3; i++)
+        if (!(discounts[i]>0.0 && discounts[i]<=i)) {
+            discounts[1] = discounts[2] = discounts[3] = y;
+            break;
+        }
+}
+
+// Probability of the last word given the other words, backs off to the lower orders
+static double
+backoff_prob(const vector<NgramMap>& probs,
+        const vector<NgramMap>& backoffs,
+        const vector<int>& ngram)
+{
+    double backoff = 1.0;
+    vector<int> key;
+    for (size_t start = 0; start<ngram.size(); start++) {
+        key.assign(ngram.begin()+start, ngram.end());
+        auto pit = probs[key.size()].find(key);
+        if (pit!=probs[key.size()].end()) return backoff*pit->second;
+        key.pop_back();
+        auto bit = backoffs[key.size()].find(key);
+        if (bit!=backoffs[key.size()].end()) backoff *= bit->second;
+    }
+    throw string("Word missing from the unigrams");
+}
+
+void
+estimate_class_ngram(const ClassNgramCounts& counts,
+        const vector<string>& vocabulary,
+        Smoothing smoothing,
+        LNNgram& ngram)
+{
+    int max_order = counts.m_order;
+
+    vector<string> words;
+    unordered_map<string, int> word_lookup;
+    auto word_index = [&](const string& word) {
+        auto wit = word_lookup.find(word);
+        if (wit!=word_lookup.end()) return wit->second;
+        words.push_back(word);
+        word_lookup[word] = words.size()-1;
+        return (int) words.size()-1;
+    };
+    for (auto vit = vocabulary.begin(); vit!=vocabulary.end(); ++vit)
+        word_index(*vit);
+    int sentence_begin = word_index(SENTENCE_BEGIN_SYMBOL);
+    word_index(SENTENCE_END_SYMBOL);
+    word_index(UNK_SYMBOL);
+
+    vector<NgramMap> raw_counts(max_order+1);
+    vector<int> curr_ngram;
+    for (auto cit = counts.m_counts.begin(); cit!=counts.m_counts.end(); ++cit) {
+        if ((int) cit->first.size()>max_order) continue;
+        curr_ngram.clear();
+        for (auto sit = cit->first.begin(); sit!=cit->first.end(); ++sit)
+            curr_ngram.push_back(word_index(ClassNgramCounts::symbol(*sit)));
+        raw_counts[curr_ngram.size()][curr_ngram] += cit->second;
+    }
+
+    // Kneser-Ney uses continuation counts for the lower orders except
+    // for n-grams starting with the sentence begin symbol
+    vector<NgramMap> event_counts(raw_counts);
+    if (smoothing==KNESER_NEY) {
+        for (int order = 1; order<max_order; order++) {
+            NgramMap& order_counts = event_counts[order];
+            for (auto eit = order_counts.begin(); eit!=order_counts.end(); ++eit)
+                if (eit->first[0]!=sentence_begin) eit->second = 0.0;
+            for (auto hit = raw_counts[order+1].begin(); hit!=raw_counts[order+1].end(); ++hit) {
+                if (hit->second<=0.0) continue;
+                curr_ngram.assign(hit->first.begin()+1, hit->first.end());
+                order_counts[curr_ngram] += 1.0;
+            }
+        }
+    }
+
+    // Interpolated estimates, the lower order weight of a context is also its backoff weight
+    vector<NgramMap> probs(max_order+1);
+    vector<NgramMap> backoffs(max_order+1);
+    for (int order = 1; order<=max_order; order++) {
+        const NgramMap& order_counts = event_counts[order];
+
+        unordered_map<vector<int>, ContextStats, ClassNgramCounts::NgramHash> contexts;
+        vector<int> context;
+        if (order==1) contexts[context] = ContextStats();
+        for (auto eit = order_counts.begin(); eit!=order_counts.end(); ++eit) {
+            if (eit->first.back()==sentence_begin) continue;
+            context.assign(eit->first.begin(), eit->first.end()-1);
+            ContextStats& stats = contexts[context];
+            stats.total += eit->second;
+            int bin = count_bin(eit->second);
+            if (bin>0) stats.types++;
+            if (bin==1) stats.n1++;
+            else if (bin==2) stats.n2++;
+            else if (bin==3) stats.n3++;
+        }
+
+        double discounts[4];
+        if (smoothing==KNESER_NEY) kn_discounts(order_counts, sentence_begin, discounts);
+
+        NgramMap& order_backoffs = backoffs[order-1];
+        for (auto cit = contexts.begin(); cit!=contexts.end(); ++cit) {
+            const ContextStats& stats = cit->second;
+            double lower_order_weight = 1.0;
+            if (stats.total>0.0) {
+                if (smoothing==WITTEN_BELL)
+                    lower_order_weight = stats.types/(stats.total+stats.types);
+                else
+                    lower_order_weight = (discounts[1]*stats.n1+discounts[2]*stats.n2+discounts[3]*stats.n3)
+                            /stats.total;
+            }
+            order_backoffs[cit->first] = lower_order_weight;
+        }
+
+        auto discounted_prob = [&](double count, const ContextStats& stats) {
+            if (stats.total<=0.0) return 0.0;
+            if (smoothing==WITTEN_BELL) return count/(stats.total+stats.types);
+            return max(count-discounts[count_bin(count)], 0.0)/stats.total;
+        };
+
+        NgramMap& order_probs = probs[order];
+        if (order==1) {
+            const ContextStats& stats = contexts[context];
+            double uniform_prob = order_backoffs[context]/(double) (words.size()-1);
+            for (int w = 0; w<(int) words.size(); w++) {
+                curr_ngram.assign(1, w);
+                if (w==sentence_begin) {
+                    order_probs[curr_ngram] = 0.0;
+                    continue;
+                }
+                auto eit = order_counts.find(curr_ngram);
+                double count = eit!=order_counts.end() ? eit->second : 0.0;
+                order_probs[curr_ngram] = discounted_prob(count, stats)+uniform_prob;
+            }
+            continue;
+        }
+
+        for (auto eit = order_counts.begin(); eit!=order_counts.end(); ++eit) {
+            if (eit->first.back()==sentence_begin) continue;
+            context.assign(eit->first.begin(), eit->first.end()-1);
+            curr_ngram.assign(eit->first.begin()+1, eit->first.end());
+            order_probs[eit->first] =
+                    discounted_prob(eit->second, contexts[context])
+                    +order_backoffs[context]*backoff_prob(probs, backoffs, curr_ngram);
+        }
+    }
+
+    vector<vector<int>> ngram_words(max_order);
+    vector<vector<double>> ngram_probs(max_order);
+    vector<vector<double>> ngram_backoff_probs(max_order);
+    for (int order = 1; order<=max_order; order++) {
+        vector<const pair<const vector<int>, double>*> order_ngrams;
+        for (auto pit = probs[order].begin(); pit!=probs[order].end(); ++pit)
+            order_ngrams.push_back(&(*pit));
+        if (order==1)
+            sort(order_ngrams.begin(), order_ngrams.end(),
+                    [](const pair<const vector<int>, double>* a, const pair<const vector<int>, double>* b)
+                    { return a->first<b->first; });
+
+        for (auto nit = order_ngrams.begin(); nit!=order_ngrams.end(); ++nit) {
+            const vector<int>& ngram_key = (*nit)->first;
+            double prob = (*nit)->second;
+            ngram_words[order-1].insert(ngram_words[order-1].end(), ngram_key.begin(), ngram_key.end());
+            ngram_probs[order-1].push_back(prob>0.0 ? log(prob) : ZERO_LOG_PROB);
+            auto bit = backoffs[order].find(ngram_key);
+            double backoff = bit!=backoffs[order].end() ? bit->second : 1.0;
+            ngram_backoff_probs[order-1].push_back(backoff>0.0 ? log(backoff) : ZERO_LOG_PROB);
+        }
+    }
+
+    ngram.build_model(words, ngram_words, ngram_probs, ngram_backoff_probs);
+}
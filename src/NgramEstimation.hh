@@ -0,0 +1,23 @@
+#ifndef NGRAM_ESTIMATION
+#define NGRAM_ESTIMATION
+
+#include <string>
+#include <vector>
+
+#include "Categories.hh"
+#include "Ngram.hh"
+
+enum Smoothing { WITTEN_BELL = 0, KNESER_NEY = 1 };
+
+Smoothing get_smoothing(std::string smoothing);
+
+// Estimates an interpolated Witten-Bell or modified Kneser-Ney model from the
+// class n-gram counts up to the order of the counts. The vocabulary may add
+// symbols without counts, they get probability mass from the uniform distribution.
+// Kneser-Ney expects whole counts as collected from single parses.
+void estimate_class_ngram(const ClassNgramCounts& counts,
+        const std::vector<std::string>& vocabulary,
+        Smoothing smoothing,
+        LNNgram& ngram);
+
+#endif /* NGRAM_ESTIMATION */
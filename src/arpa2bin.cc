@@ -0,0 +1,39 @@
+#include "conf.hh"
+#include "Ngram.hh"
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    conf::Config config;
+    config("usage: arpa2bin [OPTION...] INPUT_MODEL OUTPUT_MODEL\n")
+            ('l', "log10", "", "", "Store log10 probabilities, DEFAULT: natural logarithm as used by the tools")
+            ('c', "compact=INT", "arg", "",
+                    "Compact node layout with 32-bit float or 16-bit quantized probabilities")
+            ('a', "write-arpa", "", "", "Write an ARPA model, the input may be binary or ARPA")
+            ('h', "help", "", "", "display help");
+    config.default_parse(argc, argv);
+    if (config.arguments.size()!=2) config.print_help(stderr, 1);
+
+    string infname = config.arguments[0];
+    string outfname = config.arguments[1];
+
+    try {
+        Ngram log10_ngram;
+        LNNgram ln_ngram;
+        Ngram& ngram = config["log10"].specified ? log10_ngram : ln_ngram;
+        ngram.read_model(infname);
+        if (config["compact"].specified)
+            ngram.compact(config["compact"].get_int());
+        if (config["write-arpa"].specified)
+            ngram.write_arpa(outfname);
+        else
+            ngram.write_binary(outfname);
+    }
+    catch (string& e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
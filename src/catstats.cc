@@ -4,39 +4,181 @@
 #include <sstream>
 #include <thread>
 #include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <map>
 
 #include "defs.hh"
 #include "io.hh"
 #include "conf.hh"
 #include "Categories.hh"
 #include "Ngram.hh"
+#include "NgramEstimation.hh"
+#include "Corpus.hh"
 
 using namespace std;
 
-bool
-process_sent(
-        string line,
+// Sentences of the corpus as vocabulary indices, words outside the vocabulary are unk.
+// With folding the whole corpus is read first and each distinct sentence is returned
+// once with its number of occurrences, otherwise the lines are read one at a time.
+class CorpusSentences {
+public:
+    CorpusSentences(string corpusfname,
+            const set<string>& vocab,
+            const TrainingParameters& params);
+    bool next(vector<int>& sent, unsigned int& count);
+    unsigned long int num_distinct() const { return m_corpus.size(); }
+    const vector<string>& words() const { return m_corpus.m_words; }
+
+private:
+    SimpleFileInput m_corpusf;
+    const TrainingParameters& m_params;
+    Corpus m_corpus;
+    unsigned long int m_next_sent;
+};
+
+CorpusSentences::CorpusSentences(string corpusfname,
         const set<string>& vocab,
-        const TrainingParameters& params,
-        vector<string>& sent)
+        const TrainingParameters& params)
+        :m_corpusf(corpusfname), m_params(params), m_next_sent(0)
+{
+    m_corpus.set_vocabulary(vocab);
+    if (params.fold_sentences)
+        m_corpus.read(corpusfname, params.max_line_length, true);
+}
+
+bool
+CorpusSentences::next(vector<int>& sent, unsigned int& count)
 {
-    sent.clear();
-    stringstream ss(line);
-    string word;
-    while (ss >> word) {
-        if (word==SENTENCE_BEGIN_SYMBOL || word==SENTENCE_END_SYMBOL) continue;
-        sent.push_back(word);
+    if (m_params.fold_sentences) {
+        if (m_next_sent>=m_corpus.size()) return false;
+        m_corpus.get_sentence(m_next_sent, sent);
+        count = m_corpus.m_sentence_counts[m_next_sent++];
+        return true;
     }
-    if (sent.size()>params.max_line_length) return false;
-    if (sent.size()==0) return false;
 
-    for (auto wit = sent.begin(); wit!=sent.end(); ++wit)
-        if (vocab.find(*wit)==vocab.end())
-            wit->assign(UNK_SYMBOL);
+    string line;
+    while (m_corpusf.getline(line)) {
+        if (!m_corpus.process_line(line, m_params.max_line_length, sent)) continue;
+        count = 1;
+        return true;
+    }
+    return false;
+}
+
+static void
+get_sentence_words(const vector<int>& word_ids,
+        const vector<string>& words,
+        vector<string>& sent)
+{
+    sent.resize(word_ids.size());
+    for (unsigned int i = 0; i<word_ids.size(); i++)
+        sent[i] = words[word_ids[i]];
+}
+
+class SentenceBatch {
+public:
+    SentenceBatch() :m_index(0) { };
+    unsigned long int m_index;
+    vector<vector<int>> m_sents;
+    vector<unsigned int> m_counts;
+};
+
+// Bounded queue of sentence batches from the corpus reader to the worker threads.
+// Workers take the next batch when they are done, which balances the load.
+class SentenceQueue {
+public:
+    SentenceQueue(unsigned int max_batches)
+            :m_max_batches(max_batches), m_closed(false) { };
+    // The sentences are swapped into the queue and left empty
+    void push(SentenceBatch& batch);
+    bool pop(SentenceBatch& batch);
+    void close();
 
+private:
+    unsigned int m_max_batches;
+    bool m_closed;
+    deque<SentenceBatch> m_batches;
+    mutex m_mutex;
+    condition_variable m_not_empty;
+    condition_variable m_not_full;
+};
+
+static const unsigned int SENTENCE_BATCH_SIZE = 64;
+
+void
+SentenceQueue::push(SentenceBatch& batch)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_not_full.wait(lock, [this] { return m_batches.size()<m_max_batches; });
+    m_batches.emplace_back();
+    m_batches.back().m_index = batch.m_index;
+    m_batches.back().m_sents.swap(batch.m_sents);
+    m_batches.back().m_counts.swap(batch.m_counts);
+    m_not_empty.notify_one();
+}
+
+bool
+SentenceQueue::pop(SentenceBatch& batch)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_not_empty.wait(lock, [this] { return m_batches.size()>0 || m_closed; });
+    if (m_batches.size()==0) return false;
+    batch.m_index = m_batches.front().m_index;
+    batch.m_sents.swap(m_batches.front().m_sents);
+    batch.m_counts.swap(m_batches.front().m_counts);
+    m_batches.pop_front();
+    m_not_full.notify_one();
     return true;
 }
 
+void
+SentenceQueue::close()
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_closed = true;
+    m_not_empty.notify_all();
+}
+
+// Writes the category sequences formatted by the workers to one file.
+// With the batch order kept, batches finished early wait for the preceding ones.
+class CatseqWriter {
+public:
+    CatseqWriter(string fname,
+            unsigned int num_threads,
+            bool keep_order)
+            :m_seqf(fname, 6, num_threads), m_keep_order(keep_order), m_next_batch(0) { };
+    // The lines are swapped out and left empty
+    void write(unsigned long int batch_idx, string& lines);
+    void close() { m_seqf.close(); }
+
+private:
+    SimpleFileOutput m_seqf;
+    bool m_keep_order;
+    unsigned long int m_next_batch;
+    map<unsigned long int, string> m_pending;
+    mutex m_mutex;
+};
+
+void
+CatseqWriter::write(unsigned long int batch_idx, string& lines)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_keep_order) {
+        m_seqf << lines;
+        lines.clear();
+        return;
+    }
+
+    m_pending[batch_idx].swap(lines);
+    while (m_pending.size()>0 && m_pending.begin()->first==m_next_batch) {
+        m_seqf << m_pending.begin()->second;
+        m_pending.erase(m_pending.begin());
+        m_next_batch++;
+    }
+}
+
 void
 catstats(
         string corpusfname,
@@ -45,34 +187,34 @@ catstats(
         const vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        Categories& stats,
+        CategoryStats& stats,
+        ClassNgramCounts* counts,
         string modelfname,
         unsigned long int& num_vocab_words,
         unsigned long int& num_oov_words,
         unsigned long int& num_sents,
-        flt_type& total_ll,
-        unsigned int num_threads = 1,
-        unsigned int thread_idx = 0)
+        flt_type& total_ll)
 {
     SimpleFileOutput* seqf = nullptr;
-    if (modelfname.length()>0)
+    if (modelfname.length()>0 && counts==nullptr)
         seqf = new SimpleFileOutput(modelfname+".catseq.gz");
 
-    SimpleFileInput corpusf(corpusfname);
-    string line;
-    unsigned long int senti = 0;
-    while (corpusf.getline(line)) {
-        senti++;
-        if (senti%num_threads!=thread_idx) continue;
-        vector<string> sent;
-        if (!process_sent(line, vocab, params, sent)) continue;
+    CorpusSentences sentences(corpusfname, vocab, params);
+    vector<int> word_ids;
+    vector<string> sent;
+    unsigned int count;
+    while (sentences.next(word_ids, count)) {
+        get_sentence_words(word_ids, sentences.words(), sent);
         total_ll += collect_stats(sent,
                 cngram, indexmap,
                 categories, params,
-                stats, seqf,
-                &num_vocab_words, &num_oov_words);
-        num_sents++;
+                stats, seqf, counts,
+                &num_vocab_words, &num_oov_words,
+                nullptr, nullptr, count);
+        num_sents += count;
     }
+    if (params.fold_sentences)
+        cerr << "Number of distinct sentences: " << sentences.num_distinct() << endl;
 
     if (seqf!=nullptr) {
         seqf->close();
@@ -80,6 +222,49 @@ catstats(
     }
 }
 
+void
+catstats_worker(
+        SentenceQueue& queue,
+        const vector<string>& words,
+        const LNNgram& cngram,
+        const vector<int>& indexmap,
+        const Categories& categories,
+        const TrainingParameters& params,
+        CategoryStats& stats,
+        ClassNgramCounts* counts,
+        CatseqWriter* writer,
+        unsigned long int& num_vocab_words,
+        unsigned long int& num_oov_words,
+        unsigned long int& num_sents,
+        flt_type& total_ll)
+{
+    string lines;
+    SimpleFileOutput* seqf = nullptr;
+    if (writer!=nullptr) seqf = new SimpleFileOutput(lines, true);
+
+    vector<string> sent;
+    SentenceBatch batch;
+    while (queue.pop(batch)) {
+        for (unsigned int i = 0; i<batch.m_sents.size(); i++) {
+            get_sentence_words(batch.m_sents[i], words, sent);
+            total_ll += collect_stats(sent,
+                    cngram, indexmap,
+                    categories, params,
+                    stats, seqf, counts,
+                    &num_vocab_words, &num_oov_words,
+                    nullptr, nullptr, batch.m_counts[i]);
+            num_sents += batch.m_counts[i];
+        }
+        if (seqf!=nullptr) {
+            seqf->flush();
+            writer->write(batch.m_index, lines);
+        }
+    }
+
+    delete seqf;
+}
+
+// The corpus is read and preprocessed once in the calling thread
 flt_type
 catstats_thr(
         string corpusfname,
@@ -88,51 +273,80 @@ catstats_thr(
         const vector<int>& indexmap,
         const Categories& categories,
         const TrainingParameters& params,
-        Categories& stats,
+        CategoryStats& stats,
+        ClassNgramCounts* counts,
         string modelfname,
         unsigned long int& num_vocab_words,
         unsigned long int& num_oov_words,
         unsigned long int& num_sents,
-        unsigned int num_threads)
+        unsigned int num_threads,
+        bool keep_order)
 {
+    CatseqWriter* writer = nullptr;
+    if (modelfname.length()>0 && counts==nullptr)
+        writer = new CatseqWriter(modelfname+".catseq.gz", num_threads, keep_order);
+
+    CorpusSentences sentences(corpusfname, vocab, params);
+    SentenceQueue queue(4*num_threads);
     vector<unsigned long int> thr_num_vocab_words(num_threads, 0);
     vector<unsigned long int> thr_num_oov_words(num_threads, 0);
     vector<unsigned long int> thr_num_sents(num_threads, 0);
     vector<flt_type> thr_ll(num_threads, 0.0);
-    vector<Categories*>thr_stats(num_threads, nullptr);
+    vector<ClassNgramCounts*>thr_counts(num_threads, nullptr);
     vector<std::thread*>workers;
     for (unsigned int t = 0; t<num_threads; t++) {
-        thr_stats[t] = new Categories(categories.num_categories());
-        string tmodelfname = modelfname;
-        if (tmodelfname.length()>0) tmodelfname += ".thread"+int2str(t);
-        std::thread* worker = new std::thread(&catstats,
-                corpusfname,
-                std::cref(vocab),
+        if (counts!=nullptr) thr_counts[t] = new ClassNgramCounts(counts->m_order);
+        std::thread* worker = new std::thread(&catstats_worker,
+                std::ref(queue),
+                std::cref(sentences.words()),
                 std::cref(cngram),
                 std::cref(indexmap),
                 std::cref(categories),
                 std::cref(params),
-                std::ref(*(thr_stats[t])),
-                tmodelfname,
+                std::ref(stats),
+                thr_counts[t],
+                writer,
                 std::ref(thr_num_vocab_words[t]),
                 std::ref(thr_num_oov_words[t]),
                 std::ref(thr_num_sents[t]),
-                std::ref(thr_ll[t]),
-                num_threads,
-                t);
+                std::ref(thr_ll[t]));
         workers.push_back(worker);
     }
+
+    vector<int> sent;
+    unsigned int count;
+    SentenceBatch batch;
+    while (sentences.next(sent, count)) {
+        batch.m_sents.push_back(std::move(sent));
+        batch.m_counts.push_back(count);
+        if (batch.m_sents.size()>=SENTENCE_BATCH_SIZE) {
+            queue.push(batch);
+            batch.m_index++;
+        }
+    }
+    if (batch.m_sents.size()>0) queue.push(batch);
+    queue.close();
+    if (params.fold_sentences)
+        cerr << "Number of distinct sentences: " << sentences.num_distinct() << endl;
+
     flt_type total_ll = 0.0;
     for (unsigned int t = 0; t<num_threads; t++) {
         workers[t]->join();
-        stats.accumulate(*(thr_stats[t]));
-        delete thr_stats[t];
+        if (counts!=nullptr) {
+            counts->accumulate(*(thr_counts[t]));
+            delete thr_counts[t];
+        }
         num_vocab_words += thr_num_vocab_words[t];
         num_oov_words += thr_num_oov_words[t];
         num_sents += thr_num_sents[t];
         total_ll += thr_ll[t];
         delete workers[t];
     }
+
+    if (writer!=nullptr) {
+        writer->close();
+        delete writer;
+    }
     return total_ll;
 }
 
@@ -150,9 +364,23 @@ int main(int argc, char* argv[])
             ('o', "max-order=INT", "arg", "", "Maximum context length (DEFAULT: MODEL ORDER)")
             ('b', "prob-beam=FLOAT", "arg", "100.0", "Probability beam (default 100.0)")
             ('u', "update-categories", "", "", "Update category generation and membership probabilities")
+            ('m', "recombine", "", "",
+                    "Merge hypotheses with the same class n-gram state and category generation context")
+            ('w', "forward-backward", "", "",
+                    "Collect category statistics with forward-backward over the pruned lattice, implies -m")
+            ('d', "fold-sentences", "", "",
+                    "Decode repeated sentences once and weight them by their count, reads the whole corpus to memory")
             ('g', "tagging=INT", "arg", "0", "Tagging mode 0=no (DEFAULT) 1=first unk in sentence 2=all")
             ('t', "num-threads=INT", "arg", "1", "Number of threads")
+            ('a', "any-order", "", "",
+                    "Write the category sequences of multiple threads in the order they are finished")
             ('c', "num-categories=INT", "arg", "10", "Upper limit for the number of categories per word")
+            ('r', "count-order=INT", "arg", "",
+                    "Collect class n-gram counts up to this order to MODEL.ccounts.gz instead of writing MODEL.catseq.gz")
+            ('e', "estimate=STRING", "arg", "",
+                    "Estimate the class n-gram model from the counts with wb or kn smoothing to MODEL.arpa.gz")
+            ('s', "score-cache=INT", "arg", "20",
+                    "Size of the shared n-gram score cache as a power of two, 0 disables (DEFAULT: 20)")
             ('h', "help", "", "", "display help");
     config.default_parse(argc, argv);
     if (config.arguments.size()!=4 && config.arguments.size()!=5)
@@ -173,8 +401,22 @@ int main(int argc, char* argv[])
     params.max_line_length = config["max-line-length"].get_int();
     params.prob_beam = config["prob-beam"].get_float();
     params.tagging = static_cast<TaggingMode>(config["tagging"].get_int());
+    params.recombine = config["recombine"].specified || config["forward-backward"].specified;
+    params.forward_backward = config["forward-backward"].specified;
+    params.fold_sentences = config["fold-sentences"].specified;
     bool update_categories = config["update-categories"].specified;
 
+    Smoothing smoothing = WITTEN_BELL;
+    if (config["estimate"].specified) {
+        try {
+            smoothing = get_smoothing(config["estimate"].get_str());
+        }
+        catch (string& e) {
+            cerr << e << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (params.num_parses>params.num_final_tokens) {
         cerr << "Warning, num-parses higher than num-final-tokens" << endl;
         cerr << "num-parses set to: " << params.num_final_tokens << endl;
@@ -186,19 +428,33 @@ int main(int argc, char* argv[])
     wcs.read_category_gen_probs(cgenpfname);
     cerr << "Reading category membership probs.." << endl;
     wcs.read_category_mem_probs(cmempfname);
+    wcs.freeze();
 
     cerr << "Reading category n-gram model.." << endl;
     LNNgram cngram;
-    cngram.read_arpa(cngramfname);
+    cngram.num_read_threads = config["num-threads"].get_int();
+    cngram.read_model(cngramfname);
     vector<int> indexmap = get_class_index_map(wcs.num_categories(), cngram);
+    vector<int> categorymap = get_class_category_map(indexmap, cngram);
+    params.categorymap = &categorymap;
 
     params.max_order = cngram.max_order;
     if (config["max-order"].specified) params.max_order = config["max-order"].get_int();
 
+    ScoreCache* score_cache = nullptr;
+    if (config["score-cache"].get_int()>0) {
+        score_cache = new ScoreCache(cngram, config["score-cache"].get_int());
+        params.score_cache = score_cache;
+    }
+
     set<string> vocab;
     wcs.get_words(vocab, params.tagging!=NO);
 
-    Categories stats(wcs);
+    CategoryStats stats(wcs);
+    ClassNgramCounts* counts = nullptr;
+    if ((config["count-order"].specified || config["estimate"].specified) && modelfname.length()>0)
+        counts = new ClassNgramCounts(config["count-order"].specified ? config["count-order"].get_int()
+                                                                      : cngram.max_order);
 
     unsigned long int num_vocab_words = 0;
     unsigned long int num_oov_words = 0;
@@ -208,14 +464,15 @@ int main(int argc, char* argv[])
         total_ll = catstats_thr(infname, vocab,
                 cngram, indexmap, wcs,
                 params,
-                stats, modelfname,
+                stats, counts, modelfname,
                 num_vocab_words, num_oov_words, num_sents,
-                config["num-threads"].get_int());
+                config["num-threads"].get_int(),
+                !config["any-order"].specified);
     else
         catstats(infname, vocab,
                 cngram, indexmap, wcs,
                 params,
-                stats, modelfname,
+                stats, counts, modelfname,
                 num_vocab_words, num_oov_words, num_sents, total_ll);
 
     cout << "Number of sentences processed: " << num_sents << endl;
@@ -226,14 +483,34 @@ int main(int argc, char* argv[])
     double ppl = exp(-1.0/double(num_vocab_words+num_sents)*total_ll);
     cout << "Perplexity: " << ppl << endl;
 
+    if (score_cache!=nullptr) {
+        cerr << "Score cache hits: " << score_cache->hits() << endl;
+        cerr << "Score cache misses: " << score_cache->misses() << endl;
+        delete score_cache;
+    }
+
     if (modelfname.length()==0) exit(EXIT_SUCCESS);
 
+    if (counts!=nullptr) {
+        cerr << "Number of class n-grams: " << counts->num_ngrams() << endl;
+        if (config["estimate"].specified) {
+            LNNgram estimated_cngram;
+            estimate_class_ngram(*counts, cngram.vocabulary, smoothing, estimated_cngram);
+            estimated_cngram.write_arpa(modelfname+".arpa.gz");
+        }
+        else
+            counts->write(modelfname+".ccounts.gz");
+        delete counts;
+    }
+
     if (update_categories) {
+        Categories new_wcs(wcs);
+        stats.get_stats(new_wcs);
         if (config["num-categories"].specified)
-            limit_num_categories(stats.m_stats, config["num-categories"].get_int());
-        stats.estimate_model();
-        stats.write_category_gen_probs(modelfname+".cgenprobs.gz");
-        stats.write_category_mem_probs(modelfname+".cmemprobs.gz");
+            limit_num_categories(new_wcs.m_stats, config["num-categories"].get_int());
+        new_wcs.estimate_model();
+        new_wcs.write_category_gen_probs(modelfname+".cgenprobs.gz");
+        new_wcs.write_category_mem_probs(modelfname+".cmemprobs.gz");
     }
     else {
         wcs.write_category_gen_probs(modelfname+".cgenprobs.gz");
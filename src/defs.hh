@@ -98,4 +98,17 @@ get_class_index_map(
     return indexmap;
 }
 
+// Class index for each n-gram word, -1 for words which are not classes
+static std::vector<int>
+get_class_category_map(
+        const std::vector<int>& indexmap,
+        const Ngram& cngram)
+{
+    std::vector<int> categorymap(cngram.vocabulary.size(), -1);
+    for (int i = 0; i<(int) indexmap.size(); i++)
+        if (cngram.vocabulary[indexmap[i]]==int2str(i))
+            categorymap[indexmap[i]] = i;
+    return categorymap;
+}
+
 #endif /* PROJECT_DEFS */
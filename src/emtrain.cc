@@ -0,0 +1,363 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+
+#include "defs.hh"
+#include "io.hh"
+#include "conf.hh"
+#include "Categories.hh"
+#include "Ngram.hh"
+#include "NgramEstimation.hh"
+#include "EMTraining.hh"
+#include "Corpus.hh"
+
+using namespace std;
+
+void
+collect_thr(const Corpus& corpus,
+        const vector<char>& in_vocabulary,
+        const LNNgram& cngram,
+        const vector<int>& indexmap,
+        const Categories& categories,
+        const TrainingParameters& params,
+        CategoryStats& stats,
+        ClassNgramCounts* counts,
+        unsigned long int& num_vocab_words,
+        unsigned long int& num_oov_words,
+        flt_type& total_ll,
+        unsigned long int first_sent,
+        unsigned long int last_sent,
+        unsigned int num_threads,
+        unsigned int thread_idx)
+{
+    vector<string> sent;
+    for (unsigned long int i = first_sent+thread_idx; i<last_sent; i += num_threads) {
+        corpus.get_sentence(i, in_vocabulary, sent);
+        total_ll += collect_stats(sent,
+                cngram, indexmap,
+                categories, params,
+                stats, nullptr, counts,
+                &num_vocab_words, &num_oov_words,
+                nullptr, nullptr, corpus.m_sentence_counts[i]);
+    }
+}
+
+// Runs the segmentation over the sentences [first_sent, last_sent) of the corpus.
+// Returns the likelihood and the number of predicted words including the sentence ends.
+flt_type
+collect(const Corpus& corpus,
+        const LNNgram& cngram,
+        const vector<int>& indexmap,
+        Categories& categories,
+        const TrainingParameters& params,
+        CategoryStats& stats,
+        ClassNgramCounts* counts,
+        unsigned int num_threads,
+        unsigned long int first_sent,
+        unsigned long int last_sent,
+        unsigned long int& num_words)
+{
+    set<string> vocab;
+    categories.get_words(vocab, params.tagging!=NO);
+    vector<char> in_vocabulary;
+    corpus.get_in_vocabulary(vocab, in_vocabulary);
+
+    vector<unsigned long int> thr_num_vocab_words(num_threads, 0);
+    vector<unsigned long int> thr_num_oov_words(num_threads, 0);
+    vector<flt_type> thr_ll(num_threads, 0.0);
+    vector<ClassNgramCounts*> thr_counts(num_threads, nullptr);
+    vector<std::thread*> workers;
+    for (unsigned int t = 0; t<num_threads; t++) {
+        if (counts!=nullptr) thr_counts[t] = new ClassNgramCounts(counts->m_order);
+        std::thread* worker = new std::thread(&collect_thr,
+                std::cref(corpus),
+                std::cref(in_vocabulary),
+                std::cref(cngram),
+                std::cref(indexmap),
+                std::cref(categories),
+                std::cref(params),
+                std::ref(stats),
+                thr_counts[t],
+                std::ref(thr_num_vocab_words[t]),
+                std::ref(thr_num_oov_words[t]),
+                std::ref(thr_ll[t]),
+                first_sent,
+                last_sent,
+                num_threads,
+                t);
+        workers.push_back(worker);
+    }
+
+    num_words = 0;
+    for (unsigned long int i = first_sent; i<last_sent; i++)
+        num_words += corpus.m_sentence_counts[i];
+    flt_type total_ll = 0.0;
+    for (unsigned int t = 0; t<num_threads; t++) {
+        workers[t]->join();
+        if (counts!=nullptr) {
+            counts->accumulate(*(thr_counts[t]));
+            delete thr_counts[t];
+        }
+        num_words += thr_num_vocab_words[t];
+        total_ll += thr_ll[t];
+        delete workers[t];
+    }
+
+    return total_ll;
+}
+
+// Running statistics of stepwise EM, kept over consecutive stepwise iterations
+// with the same n-gram order and category updates
+struct StepwiseState {
+    StepwiseState() :step(0), order(0), update_categories(false) { };
+    int step;
+    int order;
+    bool update_categories;
+    map<string, CategoryProbs> running_stats;
+    ClassNgramCounts running_counts;
+};
+
+// Stepwise EM for one pass over the corpus, the model is updated after every block of
+// sentences. The statistics of the kth block are interpolated to the running statistics
+// with the step size (k+2)^-step_decay, k counts the blocks from the start of the
+// consecutive stepwise iterations. The running category statistics start from the
+// expected counts under the current model and the running class n-gram counts from the
+// first block. Returns the likelihood and the number of predicted words.
+flt_type
+stepwise_iteration(const Corpus& corpus,
+        const Iteration& iteration,
+        const vector<string>& class_vocabulary,
+        TrainingParameters& params,
+        Categories& wcs,
+        LNNgram& cngram,
+        vector<int>& indexmap,
+        vector<int>& categorymap,
+        unsigned long int block_size,
+        double step_decay,
+        unsigned int num_threads,
+        StepwiseState& state,
+        unsigned long int& num_words)
+{
+    if (state.step>0
+        && (state.order!=iteration.m_order || state.update_categories!=iteration.m_update_categories))
+        state.step = 0;
+    if (state.step==0) {
+        state.order = iteration.m_order;
+        state.update_categories = iteration.m_update_categories;
+        state.running_stats.clear();
+        if (iteration.m_update_categories)
+            get_expected_category_stats(corpus.m_word_counts, wcs, state.running_stats);
+        state.running_counts = ClassNgramCounts(iteration.m_order);
+    }
+
+    flt_type total_ll = 0.0;
+    num_words = 0;
+    for (unsigned long int first_sent = 0; first_sent<corpus.size(); first_sent += block_size) {
+        unsigned long int last_sent = min(first_sent+block_size, (unsigned long int) corpus.size());
+        ScoreCache score_cache(cngram);
+        params.score_cache = &score_cache;
+        CategoryStats category_stats(wcs);
+        ClassNgramCounts counts(iteration.m_order);
+        unsigned long int block_words;
+        total_ll += collect(corpus, cngram, indexmap, wcs, params,
+                category_stats, &counts, num_threads, first_sent, last_sent, block_words);
+        params.score_cache = nullptr;
+        num_words += block_words;
+
+        unsigned long int block_sents = 0;
+        for (unsigned long int i = first_sent; i<last_sent; i++)
+            block_sents += corpus.m_sentence_counts[i];
+        double scale = (double) corpus.m_num_sentences/(double) block_sents;
+        double step_size = pow(state.step+2, -step_decay);
+
+        if (iteration.m_update_categories) {
+            Categories block_stats(wcs.num_categories());
+            category_stats.get_stats(block_stats);
+            interpolate_stats(state.running_stats, block_stats.m_stats, step_size, scale);
+            Categories stats(wcs);
+            for (auto wit = state.running_stats.begin(); wit!=state.running_stats.end(); ++wit)
+                stats.m_stats[wit->first] = wit->second;
+            if (iteration.m_max_categories>0)
+                limit_num_categories(stats.m_stats, iteration.m_max_categories);
+            stats.estimate_model();
+            wcs.m_category_gen_probs.swap(stats.m_category_gen_probs);
+            wcs.m_category_mem_probs.swap(stats.m_category_mem_probs);
+            wcs.freeze();
+        }
+
+        interpolate_counts(state.running_counts, counts, state.step==0 ? 1.0 : step_size, scale);
+        estimate_class_ngram(state.running_counts, class_vocabulary, iteration.m_smoothing, cngram);
+        indexmap = get_class_index_map(wcs.num_categories(), cngram);
+        categorymap = get_class_category_map(indexmap, cngram);
+        state.step++;
+    }
+
+    return total_ll;
+}
+
+void
+write_model(string model_id,
+        const Categories& categories,
+        const LNNgram& cngram)
+{
+    cerr << "Writing model " << model_id << endl;
+    categories.write_category_gen_probs(model_id+".cgenprobs.gz");
+    categories.write_category_mem_probs(model_id+".cmemprobs.gz");
+    cngram.write_arpa(model_id+".arpa.gz");
+}
+
+int main(int argc, char* argv[])
+{
+    conf::Config config;
+    config("usage: emtrain [OPTION...] TRAINER_CFG WORD_INIT TRAIN_CORPUS MODEL_ID\n")
+            ('e', "eval-corpus=FILE", "arg", "", "Corpus for evaluating the model after each iteration")
+            ('k', "checkpoint=INT", "arg", "0",
+                    "Write the models every INT iterations, 0 writes only the last iteration (DEFAULT: 0)")
+            ('m', "recombine", "", "",
+                    "Merge hypotheses with the same class n-gram state and category generation context")
+            ('w', "forward-backward", "", "",
+                    "Collect category statistics with forward-backward over the pruned lattice, implies -m")
+            ('d', "fold-sentences", "", "",
+                    "Decode repeated sentences once and weight them by their count")
+            ('b', "block-size=INT", "arg", "0",
+                    "Stepwise EM for Witten-Bell iterations, update the model after every INT sentences (DEFAULT: 0, after each corpus pass)")
+            ('a', "step-decay=FLOAT", "arg", "0.7",
+                    "Stepwise EM step size (k+2)^-FLOAT for the kth block of consecutive stepwise iterations, from 0.5 to 1.0 (DEFAULT: 0.7)")
+            ('t', "num-threads=INT", "arg", "1", "Number of threads")
+            ('h', "help", "", "", "display help");
+    config.default_parse(argc, argv);
+    if (config.arguments.size()!=4) config.print_help(stderr, 1);
+
+    string cfgfname = config.arguments[0];
+    string initfname = config.arguments[1];
+    string corpusfname = config.arguments[2];
+    string model_id = config.arguments[3];
+    unsigned int num_threads = max(1, config["num-threads"].get_int());
+    int checkpoint = config["checkpoint"].get_int();
+    unsigned long int block_size = max(0, config["block-size"].get_int());
+    double step_decay = config["step-decay"].get_float();
+    if (step_decay<=0.5 || step_decay>1.0) {
+        cerr << "Step decay should be greater than 0.5 and at most 1.0" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    try {
+        vector<Iteration> schedule;
+        read_schedule(cfgfname, schedule);
+        int max_order = 0;
+        for (auto iit = schedule.begin(); iit!=schedule.end(); ++iit)
+            max_order = max(max_order, iit->m_order);
+
+        TrainingParameters params;
+        params.num_tokens = 100;
+        params.num_final_tokens = 10;
+        params.max_line_length = 100;
+        params.prob_beam = 100.0;
+        params.max_order = max_order;
+        params.recombine = config["recombine"].specified || config["forward-backward"].specified;
+        params.forward_backward = config["forward-backward"].specified;
+        params.fold_sentences = config["fold-sentences"].specified;
+
+        cerr << "Reading training corpus.." << endl;
+        Corpus corpus;
+        corpus.read(corpusfname, params.max_line_length, params.fold_sentences);
+        cerr << "Number of sentences: " << corpus.m_num_sentences << endl;
+        if (params.fold_sentences)
+            cerr << "Number of distinct sentences: " << corpus.size() << endl;
+        Corpus eval_corpus;
+        if (config["eval-corpus"].specified)
+            eval_corpus.read(config["eval-corpus"].get_str(), params.max_line_length, params.fold_sentences);
+
+        vector<string> class_vocabulary;
+        read_class_vocabulary(initfname, class_vocabulary);
+        Categories wcs(initfname, corpus.m_word_counts);
+        wcs.assert_category_gen_probs();
+        wcs.freeze();
+        ClassNgramCounts init_counts(1);
+        get_class_unigram_counts(corpus.m_word_counts, wcs, init_counts);
+        LNNgram cngram;
+        estimate_class_ngram(init_counts, class_vocabulary, WITTEN_BELL, cngram);
+        vector<int> indexmap = get_class_index_map(wcs.num_categories(), cngram);
+        vector<int> categorymap = get_class_category_map(indexmap, cngram);
+        params.categorymap = &categorymap;
+
+        TrainingParameters eval_params(params);
+        eval_params.num_parses = 10;
+        auto evaluate = [&](string iter_id) {
+            if (!config["eval-corpus"].specified) return;
+            ScoreCache score_cache(cngram);
+            eval_params.score_cache = &score_cache;
+            CategoryStats eval_stats(wcs);
+            unsigned long int num_words;
+            flt_type ll = collect(eval_corpus, cngram, indexmap, wcs, eval_params,
+                    eval_stats, nullptr, num_threads, 0, eval_corpus.size(), num_words);
+            cout << iter_id << " evaluation corpus perplexity: " << exp(-1.0/double(num_words)*ll) << endl;
+        };
+
+        string iter_id = model_id+".iter0";
+        if (checkpoint>0) write_model(iter_id, wcs, cngram);
+        evaluate(iter_id);
+
+        StepwiseState stepwise;
+        for (int i = 0; i<(int) schedule.size(); i++) {
+            const Iteration& iteration = schedule[i];
+            iter_id = model_id+"."+iteration.m_name;
+            cerr << endl << "Training " << iter_id << endl;
+
+            params.tagging = iteration.m_tagging;
+            params.num_parses = iteration.m_smoothing==KNESER_NEY ? 1 : 10;
+            flt_type total_ll;
+            unsigned long int num_words;
+            if (block_size>0 && iteration.m_smoothing==KNESER_NEY)
+                cerr << "Kneser-Ney needs whole counts, stepwise EM is used only with Witten-Bell" << endl;
+            if (block_size>0 && iteration.m_smoothing==WITTEN_BELL) {
+                total_ll = stepwise_iteration(corpus, iteration, class_vocabulary, params,
+                        wcs, cngram, indexmap, categorymap,
+                        block_size, step_decay, num_threads, stepwise, num_words);
+            }
+            else {
+                stepwise.step = 0;
+                ScoreCache score_cache(cngram);
+                params.score_cache = &score_cache;
+
+                CategoryStats category_stats(wcs);
+                ClassNgramCounts counts(iteration.m_order);
+                total_ll = collect(corpus, cngram, indexmap, wcs, params,
+                        category_stats, &counts, num_threads, 0, corpus.size(), num_words);
+                params.score_cache = nullptr;
+
+                if (iteration.m_update_categories) {
+                    Categories stats(wcs);
+                    category_stats.get_stats(stats);
+                    if (iteration.m_max_categories>0)
+                        limit_num_categories(stats.m_stats, iteration.m_max_categories);
+                    stats.estimate_model();
+                    wcs.m_category_gen_probs.swap(stats.m_category_gen_probs);
+                    wcs.m_category_mem_probs.swap(stats.m_category_mem_probs);
+                    wcs.freeze();
+                }
+
+                estimate_class_ngram(counts, class_vocabulary, iteration.m_smoothing, cngram);
+                indexmap = get_class_index_map(wcs.num_categories(), cngram);
+                categorymap = get_class_category_map(indexmap, cngram);
+            }
+            cout << iter_id << " likelihood: " << total_ll
+                 << ", perplexity: " << exp(-1.0/double(num_words)*total_ll) << endl;
+
+            bool last = i==(int) schedule.size()-1;
+            if (last || (checkpoint>0 && (i+1)%checkpoint==0))
+                write_model(iter_id, wcs, cngram);
+            evaluate(iter_id);
+        }
+    }
+    catch (string& e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
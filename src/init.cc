@@ -7,40 +7,6 @@
 
 using namespace std;
 
-void
-write_class_unigram_counts(const map<string, int>& word_counts,
-        const Categories& wcl,
-        string countfname)
-{
-    map<string, flt_type> category_counts;
-    for (auto wit = word_counts.cbegin(); wit!=word_counts.cend(); ++wit) {
-        if (wit->first==SENTENCE_BEGIN_SYMBOL || wit->first==SENTENCE_END_SYMBOL
-                || wit->first==UNK_SYMBOL) {
-            category_counts[wit->first] += wit->second;
-            continue;
-        }
-        else if (wit->first==CAP_UNK_SYMBOL) {
-            category_counts[UNK_SYMBOL] += wit->second;
-            continue;
-        }
-        if (wcl.m_category_gen_probs.find(wit->first)==wcl.m_category_gen_probs.end())
-            continue;
-        const CategoryProbs& cprobs = wcl.m_category_gen_probs.at(wit->first);
-        if (cprobs.size()==0)
-            category_counts[UNK_SYMBOL] += wit->second;
-        else {
-            flt_type tmp = 1.0/(flt_type) cprobs.size();
-            for (auto catit = cprobs.cbegin(); catit!=cprobs.end(); ++catit)
-                category_counts[int2str(catit->first)] += wit->second*tmp;
-        }
-    }
-
-    SimpleFileOutput countf(countfname);
-    for (auto cit = category_counts.begin(); cit!=category_counts.end(); ++cit)
-        countf << cit->first << "\t" << cit->second << "\n";
-    countf.close();
-}
-
 int main(int argc, char* argv[])
 {
     conf::Config config;
@@ -69,7 +35,9 @@ int main(int argc, char* argv[])
 
         wcl.write_category_gen_probs(model_fname+".cgenprobs.gz");
         wcl.write_category_mem_probs(model_fname+".cmemprobs.gz");
-        write_class_unigram_counts(word_counts, wcl, model_fname+".ccounts.gz");
+        ClassNgramCounts counts(1);
+        get_class_unigram_counts(word_counts, wcl, counts);
+        counts.write(model_fname+".ccounts.gz");
 
     }
     catch (string& e) {
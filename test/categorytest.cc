@@ -2,8 +2,11 @@
 
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <set>
 #include <vector>
 #include <string>
+#include <thread>
 
 #define private public
 #include "Categories.hh"
@@ -11,9 +14,414 @@
 
 using namespace std;
 
+// Two word sentence, the first word in classes 2453 and 4239, the second in 4239
+struct TwoWordSentence {
+    TwoWordSentence() {
+        wcs.m_num_categories = 4240;
+        wcs.m_category_gen_probs["ulkona"] = { { 2453, log(0.4) }, { 4239, log(0.6) } };
+        wcs.m_category_mem_probs["ulkona"] = { { 2453, -8.0 }, { 4239, -9.0 } };
+        wcs.m_category_gen_probs["sataa"] = { { 4239, 0.0 } };
+        wcs.m_category_mem_probs["sataa"] = { { 4239, -5.0 } };
+        wcs.freeze();
+
+        cngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        indexmap.resize(wcs.num_categories(), 0);
+        indexmap[2453] = cngram.vocabulary_lookup["2453"];
+        indexmap[4239] = cngram.vocabulary_lookup["4239"];
+
+        params.max_order = 2;
+        sent = { "ulkona", "sataa" };
+    }
+
+    Categories wcs;
+    LNNgram cngram;
+    vector<int> indexmap;
+    TrainingParameters params;
+    vector<string> sent;
+};
+
+
+// The same sentence with the categories read from data/cprobs1.txt and data/wprobs1.txt
+struct CategoryFileSentence {
+    CategoryFileSentence() {
+        wcs.read_category_gen_probs("data/cprobs1.txt");
+        wcs.read_category_mem_probs("data/wprobs1.txt");
+        wcs.freeze();
+
+        cngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        indexmap = get_class_index_map(wcs.num_categories(), cngram);
+
+        params.max_order = 2;
+        sent = { "ulkona", "sataa" };
+    }
+
+    Categories wcs;
+    LNNgram cngram;
+    vector<int> indexmap;
+    TrainingParameters params;
+    vector<string> sent;
+};
+
+
 // Category test 1
 BOOST_AUTO_TEST_CASE(CategoryTest1)
         {
                 Categories wcs;
         }
 
+
+BOOST_AUTO_TEST_CASE(ClassNgramCounting)
+        {
+                cerr << endl;
+        ClassNgramCounts counts(2);
+        vector<int> catseq = { -1, 5, -1, 5, -1 };
+        counts.accumulate(catseq, 0.5);
+        catseq = { -1, 7, -1 };
+        counts.accumulate(catseq, 1.0);
+
+        // <s> 5 <unk> 5 </s> and <s> 7 </s>
+        BOOST_CHECK_EQUAL( counts.num_ngrams(), 11 );
+        BOOST_CHECK_EQUAL( counts.m_counts.at({ -2 }), 1.5 );
+        BOOST_CHECK_EQUAL( counts.m_counts.at({ 5 }), 1.0 );
+        BOOST_CHECK_EQUAL( counts.m_counts.at({ -1, 5 }), 0.5 );
+        BOOST_CHECK_EQUAL( counts.m_counts.at({ 7, -3 }), 1.0 );
+        BOOST_CHECK( counts.m_counts.find({ 5, -1, 5 })==counts.m_counts.end() );
+
+        ClassNgramCounts total(2);
+        total.accumulate(counts);
+        total.accumulate(counts);
+        BOOST_CHECK_EQUAL( total.m_counts.at({ -2 }), 3.0 );
+
+        total.write("categorytest.tmp.counts");
+        vector<string> lines;
+        SimpleFileInput countf("categorytest.tmp.counts");
+        string line;
+        while (countf.getline(line))
+            lines.push_back(line);
+        remove("categorytest.tmp.counts");
+        BOOST_REQUIRE_EQUAL( lines.size(), 11 );
+        BOOST_CHECK( find(lines.begin(), lines.end(), "<s>\t3")!=lines.end() );
+        BOOST_CHECK( find(lines.begin(), lines.end(), "<unk> 5\t1")!=lines.end() );
+        BOOST_CHECK( find(lines.begin(), lines.end(), "5 <unk>\t1")!=lines.end() );
+        BOOST_CHECK( find(lines.begin(), lines.end(), "<s> 5\t1")!=lines.end() );
+        }
+
+
+// Two word sentence with one class per word, tokens are linked by arena indices
+BOOST_FIXTURE_TEST_CASE(SegmentSentence, CategoryFileSentence)
+        {
+                cerr << endl;
+        vector<vector<int>> tokens;
+        TokenArena arena;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+
+        BOOST_REQUIRE_EQUAL( (int) tokens.size(), 4 );
+        BOOST_REQUIRE_EQUAL( (int) tokens.back().size(), 1 );
+        BOOST_CHECK_EQUAL( arena.size(), 4 );
+        vector<int> catseq;
+        for (int tok = tokens.back()[0]; tok!=-1; tok = arena[tok].m_prev_token)
+            catseq.push_back(arena[tok].m_category);
+        vector<int> expected = { -1, 4239, 2453, -1 };
+        BOOST_CHECK( catseq==expected );
+
+        // The arena is reused for the next sentence
+        sent = { "sataa" };
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_CHECK_EQUAL( (int) tokens.size(), 3 );
+        BOOST_CHECK_EQUAL( arena.size(), 3 );
+
+        CategoryStats category_stats(wcs);
+        flt_type ll = collect_stats(sent, cngram, indexmap, wcs, params, category_stats, nullptr, nullptr);
+        BOOST_CHECK( ll<0.0 );
+        Categories stats(wcs.num_categories());
+        category_stats.get_stats(stats);
+        BOOST_CHECK_CLOSE( stats.m_stats["sataa"][4239], 1.0, 0.0001 );
+        }
+
+
+// Paths through both categories of the first word reach the same state after the second word
+BOOST_FIXTURE_TEST_CASE(TokenRecombination, TwoWordSentence)
+        {
+                cerr << endl;
+        vector<vector<int>> tokens;
+        TokenArena arena;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) tokens[2].size(), 2 );
+        flt_type separate_lp = add_log_domain_probs(arena[tokens[2][0]].m_lp, arena[tokens[2][1]].m_lp);
+        CategoryStats stats(wcs);
+        flt_type ll = collect_stats(sent, cngram, indexmap, wcs, params, stats, nullptr, nullptr);
+
+        params.recombine = true;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) tokens[2].size(), 1 );
+        BOOST_CHECK_CLOSE( arena[tokens[2][0]].m_lp, separate_lp, 0.0001 );
+        BOOST_CHECK_EQUAL( (int) tokens.back().size(), 1 );
+        CategoryStats recombined_stats(wcs);
+        flt_type recombined_ll = collect_stats(sent, cngram, indexmap, wcs, params, recombined_stats, nullptr, nullptr);
+        BOOST_CHECK_CLOSE( recombined_ll, ll, 0.0001 );
+        }
+
+
+// A path below the histogram threshold still merges to a kept token with the same state
+BOOST_FIXTURE_TEST_CASE(RecombinedPruning, TwoWordSentence)
+        {
+                cerr << endl;
+        params.recombine = true;
+        vector<vector<int>> tokens;
+        TokenArena arena;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) tokens[1].size(), 2 );
+        BOOST_REQUIRE_EQUAL( (int) tokens[2].size(), 1 );
+        flt_type merged_lp = arena[tokens[2][0]].m_lp;
+        CategoryStats stats(wcs);
+        flt_type ll = collect_stats(sent, cngram, indexmap, wcs, params, stats, nullptr, nullptr);
+
+        // The second path to the final state is below the threshold of one token
+        params.num_final_tokens = 1;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) tokens[2].size(), 1 );
+        BOOST_CHECK_CLOSE( arena[tokens[2][0]].m_lp, merged_lp, 0.0001 );
+        CategoryStats pruned_stats(wcs);
+        flt_type pruned_ll = collect_stats(sent, cngram, indexmap, wcs, params, pruned_stats, nullptr, nullptr);
+        BOOST_CHECK_CLOSE( pruned_ll, ll, 0.0001 );
+        }
+
+
+// The best tokens are kept, also when the pruning is done during the expansion
+BOOST_FIXTURE_TEST_CASE(HistogramPrune, TwoWordSentence)
+        {
+                cerr << endl;
+        TokenArena arena;
+        vector<int> tokens;
+        vector<flt_type> scores = { -5.0, -1.0, -7.0, -3.0, -2.0, -6.0, -4.0 };
+        for (auto sit = scores.begin(); sit!=scores.end(); ++sit) {
+            Token tok;
+            tok.m_lp = *sit;
+            tokens.push_back(arena.add(tok));
+        }
+        histogram_prune(tokens, arena, 3);
+        BOOST_REQUIRE_EQUAL( (int) tokens.size(), 3 );
+        set<flt_type> kept;
+        for (auto tit = tokens.begin(); tit!=tokens.end(); ++tit)
+            kept.insert(arena[*tit].m_lp);
+        set<flt_type> expected = { -1.0, -2.0, -3.0 };
+        BOOST_CHECK( kept==expected );
+        histogram_prune(tokens, arena, 5);
+        BOOST_CHECK_EQUAL( (int) tokens.size(), 3 );
+
+        vector<vector<int>> sent_tokens;
+        segment_sent(sent, cngram, indexmap, wcs, params, sent_tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) sent_tokens[1].size(), 2 );
+        flt_type best_lp = max(arena[sent_tokens[1][0]].m_lp, arena[sent_tokens[1][1]].m_lp);
+
+        params.num_tokens = 1;
+        segment_sent(sent, cngram, indexmap, wcs, params, sent_tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) sent_tokens[1].size(), 1 );
+        BOOST_CHECK_EQUAL( arena[sent_tokens[1][0]].m_lp, best_lp );
+        }
+
+
+// A folded sentence counts as the repeated sentences
+BOOST_FIXTURE_TEST_CASE(FoldedSentence, CategoryFileSentence)
+        {
+                cerr << endl;
+        CategoryStats repeated_category_stats(wcs);
+        ClassNgramCounts repeated_counts(2);
+        unsigned long int repeated_vocab_words = 0;
+        flt_type repeated_ll = 0.0;
+        for (int i = 0; i<3; i++)
+            repeated_ll += collect_stats(sent, cngram, indexmap, wcs, params,
+                    repeated_category_stats, nullptr, &repeated_counts, &repeated_vocab_words);
+
+        CategoryStats folded_category_stats(wcs);
+        ClassNgramCounts folded_counts(2);
+        unsigned long int folded_vocab_words = 0;
+        flt_type folded_ll = collect_stats(sent, cngram, indexmap, wcs, params,
+                folded_category_stats, nullptr, &folded_counts, &folded_vocab_words,
+                nullptr, nullptr, nullptr, 3);
+
+        BOOST_CHECK_CLOSE( folded_ll, repeated_ll, 0.0001 );
+        BOOST_CHECK_EQUAL( folded_vocab_words, repeated_vocab_words );
+        Categories repeated_stats(wcs.num_categories());
+        repeated_category_stats.get_stats(repeated_stats);
+        Categories folded_stats(wcs.num_categories());
+        folded_category_stats.get_stats(folded_stats);
+        BOOST_CHECK_CLOSE( folded_stats.m_stats["sataa"][4239], 3.0, 0.0001 );
+        BOOST_CHECK_CLOSE( folded_stats.m_stats["ulkona"][2453], repeated_stats.m_stats["ulkona"][2453], 0.0001 );
+        BOOST_REQUIRE_EQUAL( folded_counts.num_ngrams(), repeated_counts.num_ngrams() );
+        for (auto cit = repeated_counts.m_counts.begin(); cit!=repeated_counts.m_counts.end(); ++cit)
+            BOOST_CHECK_CLOSE( folded_counts.m_counts[cit->first], cit->second, 0.0001 );
+        }
+
+
+// Forward-backward posteriors over the recombined lattice match the posteriors of the separate paths
+BOOST_FIXTURE_TEST_CASE(ForwardBackwardPosteriors, TwoWordSentence)
+        {
+                cerr << endl;
+        CategoryStats path_category_stats(wcs);
+        flt_type path_ll = collect_stats(sent, cngram, indexmap, wcs, params, path_category_stats, nullptr, nullptr);
+        Categories path_stats(wcs.num_categories());
+        path_category_stats.get_stats(path_stats);
+
+        params.recombine = true;
+        params.forward_backward = true;
+        CategoryStats fb_category_stats(wcs);
+        flt_type fb_ll = collect_stats(sent, cngram, indexmap, wcs, params, fb_category_stats, nullptr, nullptr);
+        Categories fb_stats(wcs.num_categories());
+        fb_category_stats.get_stats(fb_stats);
+
+        BOOST_CHECK_CLOSE( fb_ll, path_ll, 0.0001 );
+        BOOST_CHECK( path_stats.m_stats["ulkona"][2453]>0.0 );
+        BOOST_CHECK_CLOSE( fb_stats.m_stats["ulkona"][2453], path_stats.m_stats["ulkona"][2453], 0.001 );
+        BOOST_CHECK_CLOSE( fb_stats.m_stats["ulkona"][4239], path_stats.m_stats["ulkona"][4239], 0.001 );
+        BOOST_CHECK_CLOSE( fb_stats.m_stats["sataa"][4239], 1.0, 0.001 );
+        }
+
+
+BOOST_AUTO_TEST_CASE(FrozenCategories)
+        {
+                cerr << endl;
+        Categories wcs;
+        wcs.m_category_gen_probs["a"] = { { 1, log(0.4) }, { 3, log(0.6) } };
+        wcs.m_category_mem_probs["a"] = { { 1, -2.0 }, { 3, -1.0 } };
+        wcs.m_category_gen_probs["b"] = CategoryProbs();
+        wcs.m_category_mem_probs["b"] = CategoryProbs();
+        BOOST_CHECK( !wcs.frozen() );
+        wcs.freeze();
+        BOOST_CHECK( wcs.frozen() );
+
+        BOOST_CHECK_EQUAL( wcs.get_word_index("c"), -1 );
+        int word_idx = wcs.get_word_index("b");
+        BOOST_REQUIRE( word_idx!=-1 );
+        BOOST_CHECK( wcs.entries_begin(word_idx)==wcs.entries_end(word_idx) );
+
+        word_idx = wcs.get_word_index("a");
+        BOOST_REQUIRE( word_idx!=-1 );
+        const CategoryEntry* entries = wcs.entries_begin(word_idx);
+        BOOST_REQUIRE_EQUAL( (int) (wcs.entries_end(word_idx)-entries), 2 );
+        BOOST_CHECK_EQUAL( entries[0].m_category, 1 );
+        BOOST_CHECK_CLOSE( entries[0].m_gen_lp, log(0.4), 0.0001 );
+        BOOST_CHECK_EQUAL( entries[0].m_mem_lp, -2.0 );
+        BOOST_CHECK_EQUAL( entries[1].m_category, 3 );
+        BOOST_CHECK_EQUAL( entries[1].m_mem_lp, -1.0 );
+
+        wcs.m_category_mem_probs["d"] = { { 2, -1.0 } };
+        BOOST_CHECK_THROW( wcs.freeze(), string );
+        }
+
+
+BOOST_AUTO_TEST_CASE(SharedCategoryStats)
+        {
+                cerr << endl;
+        Categories wcs;
+        wcs.m_category_gen_probs["a"] = { { 1, log(0.4) }, { 3, log(0.6) } };
+        wcs.m_category_mem_probs["a"] = { { 1, -2.0 }, { 3, -1.0 } };
+        wcs.m_category_gen_probs["b"] = CategoryProbs();
+        wcs.m_category_mem_probs["b"] = CategoryProbs();
+        wcs.freeze();
+
+        CategoryStats category_stats(wcs);
+        int a_idx = wcs.get_word_index("a");
+        int b_idx = wcs.get_word_index("b");
+        vector<std::thread> workers;
+        for (int t = 0; t<4; t++)
+            workers.emplace_back([&]() {
+                for (int i = 0; i<1000; i++) {
+                    category_stats.accumulate(a_idx, "a", 3, 0.5);
+                    // Tagged category outside the frozen entries
+                    category_stats.accumulate(b_idx, "b", 2, 0.25);
+                }
+            });
+        for (auto wit = workers.begin(); wit!=workers.end(); ++wit)
+            wit->join();
+
+        Categories stats(wcs);
+        category_stats.get_stats(stats);
+        BOOST_CHECK_CLOSE( stats.m_stats["a"][3], 2000.0, 0.0001 );
+        BOOST_CHECK( stats.m_stats["a"].find(1)==stats.m_stats["a"].end() );
+        BOOST_CHECK_CLOSE( stats.m_stats["b"][2], 1000.0, 0.0001 );
+        }
+
+
+// Tagged categories are the best scoring classes after the previous category
+BOOST_FIXTURE_TEST_CASE(TagHypotheses, TwoWordSentence)
+        {
+                cerr << endl;
+        wcs.m_category_gen_probs["sataa"] = CategoryProbs();
+        wcs.m_category_mem_probs["sataa"] = CategoryProbs();
+        wcs.freeze();
+        indexmap = get_class_index_map(wcs.num_categories(), cngram);
+        vector<int> categorymap = get_class_category_map(indexmap, cngram);
+        BOOST_REQUIRE_EQUAL( categorymap.size(), cngram.vocabulary.size() );
+        BOOST_CHECK_EQUAL( categorymap[indexmap[2453]], 2453 );
+        BOOST_CHECK_EQUAL( categorymap[cngram.sentence_start_symbol_idx], -1 );
+
+        params.tagging = ALL;
+        params.num_final_tokens = 100;
+        vector<vector<int>> tokens;
+        TokenArena arena;
+        segment_sent(sent, cngram, indexmap, wcs, params, tokens, arena);
+        BOOST_REQUIRE_EQUAL( (int) tokens[1].size(), 2 );
+        BOOST_REQUIRE_EQUAL( (int) tokens[2].size(), 20 );
+
+        for (auto pit = tokens[1].begin(); pit!=tokens[1].end(); ++pit) {
+            vector<double> class_scores;
+            for (int c = 0; c<wcs.num_categories(); c++) {
+                if (categorymap[indexmap[c]]!=c) continue;
+                double score = 0.0;
+                cngram.score(arena[*pit].m_cng_node, indexmap[c], score);
+                class_scores.push_back(score);
+            }
+            sort(class_scores.rbegin(), class_scores.rend());
+
+            vector<flt_type> tagged_scores;
+            set<int> tagged_categories;
+            for (auto tit = tokens[2].begin(); tit!=tokens[2].end(); ++tit)
+                if (arena[*tit].m_prev_token==*pit) {
+                    tagged_scores.push_back(arena[*tit].m_lp);
+                    tagged_categories.insert(arena[*tit].m_category);
+                }
+            sort(tagged_scores.rbegin(), tagged_scores.rend());
+            BOOST_REQUIRE_EQUAL( (int) tagged_scores.size(), 10 );
+            BOOST_CHECK_EQUAL( (int) tagged_categories.size(), 10 );
+            for (int i = 1; i<10; i++)
+                BOOST_CHECK_CLOSE( tagged_scores[i]-tagged_scores[0], class_scores[i]-class_scores[0], 0.01 );
+        }
+        }
+
+
+BOOST_AUTO_TEST_CASE(StepwiseInterpolation)
+        {
+                cerr << endl;
+        Categories wcs;
+        wcs.m_category_gen_probs["a"] = { { 1, log(0.4) }, { 3, log(0.6) } };
+        wcs.m_category_mem_probs["a"] = { { 1, -2.0 }, { 3, -1.0 } };
+        map<string, int> word_counts = { { "a", 10 }, { "c", 5 } };
+        map<string, CategoryProbs> running_stats;
+        get_expected_category_stats(word_counts, wcs, running_stats);
+        BOOST_REQUIRE_EQUAL( (int) running_stats.size(), 1 );
+        BOOST_CHECK_CLOSE( running_stats["a"][1], 4.0, 0.0001 );
+        BOOST_CHECK_CLOSE( running_stats["a"][3], 6.0, 0.0001 );
+
+        map<string, CategoryProbs> block_stats;
+        block_stats["a"][3] = 1.0;
+        block_stats["b"][2] = 1.0;
+        interpolate_stats(running_stats, block_stats, 0.5, 2.0);
+        BOOST_CHECK_CLOSE( running_stats["a"][1], 2.0, 0.0001 );
+        BOOST_CHECK_CLOSE( running_stats["a"][3], 4.0, 0.0001 );
+        BOOST_CHECK_CLOSE( running_stats["b"][2], 1.0, 0.0001 );
+
+        ClassNgramCounts running_counts(2);
+        running_counts.m_counts[{ 1 }] = 4.0;
+        ClassNgramCounts block_counts(2);
+        block_counts.m_counts[{ 1 }] = 1.0;
+        block_counts.m_counts[{ 1, 2 }] = 1.0;
+        interpolate_counts(running_counts, block_counts, 0.25, 4.0);
+        BOOST_CHECK_CLOSE( running_counts.m_counts[{ 1 }], 4.0, 0.0001 );
+        BOOST_CHECK_CLOSE( running_counts.m_counts[vector<int>({ 1, 2 })], 1.0, 0.0001 );
+
+        // The first block replaces the counts
+        interpolate_counts(running_counts, block_counts, 1.0, 3.0);
+        BOOST_CHECK_CLOSE( running_counts.m_counts[{ 1 }], 3.0, 0.0001 );
+        BOOST_CHECK_CLOSE( running_counts.m_counts[vector<int>({ 1, 2 })], 3.0, 0.0001 );
+        }
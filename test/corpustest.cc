@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+#include "Corpus.hh"
+#include "Categories.hh"
+
+using namespace std;
+
+
+// The last line is longer than the maximum line length, the empty line is skipped
+BOOST_AUTO_TEST_CASE(ReadCorpus)
+        {
+                cerr << endl;
+        Corpus corpus;
+        corpus.read("data/corpus1.txt", 5, false);
+        BOOST_CHECK_EQUAL( 5, (int)corpus.m_num_sentences );
+        BOOST_CHECK_EQUAL( 5, (int)corpus.size() );
+        for (auto cit = corpus.m_sentence_counts.begin(); cit!=corpus.m_sentence_counts.end(); ++cit)
+            BOOST_CHECK_EQUAL( 1, (int)*cit );
+
+        vector<char> in_vocabulary;
+        corpus.get_in_vocabulary({ "ulkona", "sataa" }, in_vocabulary);
+        vector<string> sent;
+        corpus.get_sentence(1, in_vocabulary, sent);
+        BOOST_REQUIRE_EQUAL( 2, (int)sent.size() );
+        BOOST_CHECK_EQUAL( "ulkona", sent[0] );
+        BOOST_CHECK_EQUAL( "sataa", sent[1] );
+        corpus.get_sentence(2, in_vocabulary, sent);
+        BOOST_REQUIRE_EQUAL( 2, (int)sent.size() );
+        BOOST_CHECK_EQUAL( "sataa", sent[0] );
+        BOOST_CHECK_EQUAL( UNK_SYMBOL, sent[1] );
+
+        map<string, int> word_counts;
+        get_word_counts("data/corpus1.txt", word_counts);
+        BOOST_CHECK( word_counts==corpus.m_word_counts );
+        BOOST_CHECK_EQUAL( 6, corpus.m_word_counts[SENTENCE_BEGIN_SYMBOL] );
+        BOOST_CHECK_EQUAL( 6, corpus.m_word_counts[SENTENCE_END_SYMBOL] );
+        BOOST_CHECK_EQUAL( 5, corpus.m_word_counts["ulkona"] );
+        BOOST_CHECK_EQUAL( 4, corpus.m_word_counts["taas"] );
+        BOOST_CHECK_EQUAL( 1, corpus.m_word_counts["ja"] );
+        }
+
+
+BOOST_AUTO_TEST_CASE(ReadCorpusFolded)
+        {
+                cerr << endl;
+        Corpus corpus;
+        corpus.read("data/corpus1.txt", 5, true);
+        BOOST_CHECK_EQUAL( 5, (int)corpus.m_num_sentences );
+        BOOST_REQUIRE_EQUAL( 3, (int)corpus.size() );
+        BOOST_CHECK_EQUAL( 2, (int)corpus.m_sentence_counts[0] );
+        BOOST_CHECK_EQUAL( 2, (int)corpus.m_sentence_counts[1] );
+        BOOST_CHECK_EQUAL( 1, (int)corpus.m_sentence_counts[2] );
+        vector<int> sent;
+        corpus.get_sentence(2, sent);
+        BOOST_CHECK_EQUAL( 3, (int)sent.size() );
+        BOOST_CHECK_EQUAL( 6, corpus.m_word_counts[SENTENCE_BEGIN_SYMBOL] );
+        BOOST_CHECK_EQUAL( 5, corpus.m_word_counts["sataa"] );
+        }
+
+
+// Sentences differing only in words outside the vocabulary are folded together
+BOOST_AUTO_TEST_CASE(ReadCorpusVocabulary)
+        {
+                cerr << endl;
+        Corpus corpus;
+        corpus.set_vocabulary({ "ulkona" });
+        corpus.read("data/corpus1.txt", 5, true);
+        BOOST_CHECK_EQUAL( 5, (int)corpus.m_num_sentences );
+        BOOST_REQUIRE_EQUAL( 3, (int)corpus.size() );
+        BOOST_REQUIRE_EQUAL( 2, (int)corpus.m_words.size() );
+
+        corpus = Corpus();
+        corpus.set_vocabulary(set<string>());
+        corpus.read("data/corpus1.txt", 5, true);
+        BOOST_REQUIRE_EQUAL( 2, (int)corpus.size() );
+        BOOST_CHECK_EQUAL( 4, (int)corpus.m_sentence_counts[0] );
+        BOOST_CHECK_EQUAL( 1, (int)corpus.m_sentence_counts[1] );
+        vector<int> sent;
+        corpus.get_sentence(0, sent);
+        BOOST_REQUIRE_EQUAL( 2, (int)sent.size() );
+        BOOST_CHECK_EQUAL( UNK_SYMBOL, corpus.m_words[sent[0]] );
+        BOOST_CHECK_EQUAL( 18, corpus.m_word_counts[UNK_SYMBOL] );
+
+        vector<int> line_sent;
+        BOOST_CHECK( corpus.process_line("<s> sataa taas </s>", 5, line_sent) );
+        BOOST_CHECK( line_sent==sent );
+        BOOST_CHECK( !corpus.process_line("<s> </s>", 5, line_sent) );
+        }
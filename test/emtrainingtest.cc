@@ -0,0 +1,64 @@
+#include <boost/test/unit_test.hpp>
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "EMTraining.hh"
+
+using namespace std;
+
+
+// Comments, other sections, = separator and Windows line endings
+BOOST_AUTO_TEST_CASE(ReadSchedule)
+        {
+                cerr << endl;
+        vector<Iteration> schedule;
+        read_schedule("data/schedule1.cfg", schedule);
+        BOOST_REQUIRE_EQUAL( 2, (int)schedule.size() );
+
+        BOOST_CHECK_EQUAL( "iter1", schedule[0].m_name );
+        BOOST_CHECK_EQUAL( WITTEN_BELL, schedule[0].m_smoothing );
+        BOOST_CHECK_EQUAL( 2, schedule[0].m_order );
+        BOOST_CHECK( !schedule[0].m_update_categories );
+        BOOST_CHECK_EQUAL( NO, schedule[0].m_tagging );
+        BOOST_CHECK_EQUAL( 5, schedule[0].m_max_categories );
+
+        BOOST_CHECK_EQUAL( "iter2", schedule[1].m_name );
+        BOOST_CHECK_EQUAL( KNESER_NEY, schedule[1].m_smoothing );
+        BOOST_CHECK_EQUAL( 3, schedule[1].m_order );
+        BOOST_CHECK( schedule[1].m_update_categories );
+        BOOST_CHECK_EQUAL( FIRST, schedule[1].m_tagging );
+        BOOST_CHECK_EQUAL( 4, schedule[1].m_max_categories );
+        }
+
+
+BOOST_AUTO_TEST_CASE(ReadScheduleErrors)
+        {
+                cerr << endl;
+        vector<Iteration> schedule;
+        BOOST_CHECK_THROW( read_schedule("data/test1.txt", schedule), string );
+        schedule.clear();
+        BOOST_CHECK_THROW( read_schedule("data/schedule2.cfg", schedule), string );
+        }
+
+
+// Word counts are split evenly over the categories of the word
+BOOST_AUTO_TEST_CASE(ClassUnigramCounts)
+        {
+                cerr << endl;
+        map<string, int> word_counts;
+        get_word_counts("data/corpus1.txt", word_counts);
+        Categories wcl("data/init1.txt", word_counts);
+        ClassNgramCounts counts(1);
+        get_class_unigram_counts(word_counts, wcl, counts);
+
+        BOOST_CHECK_EQUAL( 6.0, counts.m_counts[{ ClassNgramCounts::SENTENCE_BEGIN }] );
+        BOOST_CHECK_EQUAL( 6.0, counts.m_counts[{ ClassNgramCounts::SENTENCE_END }] );
+        BOOST_CHECK_EQUAL( 5.0, counts.m_counts[{ 0 }] );
+        BOOST_CHECK_CLOSE( 2.5+2.0/3.0, counts.m_counts[{ 1 }], 0.0001 );
+        BOOST_CHECK_CLOSE( 2.5+2.0/3.0, counts.m_counts[{ 2 }], 0.0001 );
+        BOOST_CHECK_CLOSE( 2.0/3.0, counts.m_counts[{ 3 }], 0.0001 );
+        BOOST_CHECK_EQUAL( 4.0, counts.m_counts[{ -1 }] );
+        }
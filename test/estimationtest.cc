@@ -0,0 +1,155 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include "NgramEstimation.hh"
+
+using namespace std;
+
+void
+collect_counts(ClassNgramCounts& counts,
+        int num_classes,
+        bool whole_counts)
+{
+    srand(1);
+    for (int s = 0; s<500; s++) {
+        vector<int> catseq(1, -1);
+        int length = 1+rand()%10;
+        for (int i = 0; i<length; i++) {
+            int c = rand()%(num_classes+1);
+            catseq.push_back(c==num_classes ? -1 : c);
+        }
+        catseq.push_back(-1);
+        counts.accumulate(catseq, whole_counts ? 1.0 : (1+rand()%100)/100.0);
+    }
+}
+
+void
+assert_normalized(const LNNgram& ngram)
+{
+    for (int node = 0; node<ngram.num_nodes(); node += 7) {
+        int first_arc, last_arc;
+        ngram.node_arcs(node, first_arc, last_arc);
+        if (first_arc==-1) continue;
+        double total_prob = 0.0;
+        for (int word = 0; word<(int)ngram.vocabulary.size(); word++) {
+            if (word==ngram.sentence_start_symbol_idx) continue;
+            double score = 0.0;
+            ngram.score(node, word, score);
+            total_prob += exp(score);
+        }
+        BOOST_REQUIRE_CLOSE( total_prob, 1.0, 0.001 );
+    }
+}
+
+BOOST_AUTO_TEST_CASE(WittenBellEstimation)
+        {
+                cerr << endl;
+        ClassNgramCounts counts(3);
+        collect_counts(counts, 20, false);
+        vector<string> vocabulary = { "<s>", "</s>", "<unk>", "20", "21" };
+
+        LNNgram ngram;
+        estimate_class_ngram(counts, vocabulary, WITTEN_BELL, ngram);
+        BOOST_CHECK_EQUAL( ngram.max_order, 3 );
+        BOOST_CHECK_EQUAL( ngram.vocabulary.size(), 25 );
+        assert_normalized(ngram);
+
+        // Classes without counts get their probability from the uniform distribution
+        double score = 0.0;
+        ngram.score(ngram.root_node, ngram.vocabulary_lookup["21"], score);
+        BOOST_CHECK( score<0.0 );
+        double seen_score = 0.0;
+        ngram.score(ngram.root_node, ngram.vocabulary_lookup["5"], seen_score);
+        BOOST_CHECK( seen_score>score );
+        }
+
+BOOST_AUTO_TEST_CASE(KneserNeyEstimation)
+        {
+                cerr << endl;
+        ClassNgramCounts counts(3);
+        collect_counts(counts, 20, true);
+        vector<string> vocabulary = { "<s>", "</s>", "<unk>" };
+
+        LNNgram ngram;
+        estimate_class_ngram(counts, vocabulary, KNESER_NEY, ngram);
+        BOOST_CHECK_EQUAL( ngram.max_order, 3 );
+        assert_normalized(ngram);
+        }
+
+// Bigram counts of the sentences "0 1", 2 x "1 0" and 2 x "1 1"
+void
+collect_small_counts(ClassNgramCounts& counts)
+{
+    counts.accumulate({ -1, 0, 1, -1 }, 1.0);
+    counts.accumulate({ -1, 1, 0, -1 }, 2.0);
+    counts.accumulate({ -1, 1, 1, -1 }, 2.0);
+}
+
+double
+prob(LNNgram& ngram, int node, string word)
+{
+    double score = 0.0;
+    ngram.score(node, ngram.vocabulary_lookup[word], score);
+    return exp(score);
+}
+
+// Unigram weight 3/18 and uniform prob (1/6)/4, bigram weights 3/10 after 1 and 2/7 after <s>
+BOOST_AUTO_TEST_CASE(WittenBellProbabilities)
+        {
+                cerr << endl;
+        ClassNgramCounts counts(2);
+        collect_small_counts(counts);
+        vector<string> vocabulary = { "<s>", "</s>", "<unk>" };
+        LNNgram ngram;
+        estimate_class_ngram(counts, vocabulary, WITTEN_BELL, ngram);
+
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "0"), 5.0/24.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "1"), 31.0/72.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "</s>"), 23.0/72.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "<unk>"), 1.0/24.0, 0.0001 );
+
+        int node1 = ngram.advance(ngram.root_node, ngram.vocabulary_lookup["1"]);
+        BOOST_CHECK_CLOSE( exp(ngram.node_backoff_prob(node1)), 3.0/10.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "</s>"), 19.0/48.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "1"), 79.0/240.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "<unk>"), 3.0/10.0/24.0, 0.0001 );
+
+        BOOST_CHECK_CLOSE( exp(ngram.node_backoff_prob(ngram.sentence_start_node)), 2.0/7.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.sentence_start_node, "1"), 25.0/36.0, 0.0001 );
+        }
+
+// Bigram discounts 1/4, 7/4 and 2 from the count-of-counts n1=2, n2=3, n3=1, n4=1.
+// The unigram continuation counts have no count 1 so a single discount 1/2 is used.
+BOOST_AUTO_TEST_CASE(KneserNeyProbabilities)
+        {
+                cerr << endl;
+        ClassNgramCounts counts(2);
+        collect_small_counts(counts);
+        vector<string> vocabulary = { "<s>", "</s>", "<unk>" };
+        LNNgram ngram;
+        estimate_class_ngram(counts, vocabulary, KNESER_NEY, ngram);
+
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "0"), 15.0/56.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "1"), 23.0/56.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "</s>"), 15.0/56.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.root_node, "<unk>"), 3.0/56.0, 0.0001 );
+
+        int node0 = ngram.advance(ngram.root_node, ngram.vocabulary_lookup["0"]);
+        BOOST_CHECK_CLOSE( exp(ngram.node_backoff_prob(node0)), 2.0/3.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node0, "1"), 11.0/21.0, 0.0001 );
+
+        int node1 = ngram.advance(ngram.root_node, ngram.vocabulary_lookup["1"]);
+        BOOST_CHECK_CLOSE( exp(ngram.node_backoff_prob(node1)), 11.0/14.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "0"), 193.0/784.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "1"), 281.0/784.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "</s>"), 277.0/784.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, node1, "<unk>"), 33.0/784.0, 0.0001 );
+
+        BOOST_CHECK_CLOSE( exp(ngram.node_backoff_prob(ngram.sentence_start_node)), 9.0/20.0, 0.0001 );
+        BOOST_CHECK_CLOSE( prob(ngram, ngram.sentence_start_node, "1"), 131.0/224.0, 0.0001 );
+        }
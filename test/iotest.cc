@@ -0,0 +1,143 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include "io.hh"
+
+using namespace std;
+
+void
+write_lines(string fname,
+        const vector<string>& lines,
+        bool final_newline = true)
+{
+    SimpleFileOutput outf(fname);
+    for (unsigned int i = 0; i<lines.size(); i++) {
+        outf << lines[i];
+        if (i<lines.size()-1 || final_newline) outf << "\n";
+    }
+    outf.close();
+}
+
+void
+read_lines(string fname,
+        vector<string>& lines)
+{
+    lines.clear();
+    SimpleFileInput inf(fname);
+    string line;
+    while (inf.getline(line))
+        lines.push_back(line);
+}
+
+vector<string>
+test_lines()
+{
+    vector<string> lines;
+    lines.push_back("first line");
+    lines.push_back("");
+    // Longer than the old fixed line buffer and the decompression blocks
+    lines.push_back(string(9000000, 'a'));
+    for (int i = 0; i<100000; i++)
+        lines.push_back("line "+to_string(i));
+    lines.push_back("last line");
+    return lines;
+}
+
+// Plain and compressed files with long lines
+BOOST_AUTO_TEST_CASE(ReadLines)
+        {
+                cerr << endl;
+        vector<string> lines = test_lines();
+        vector<string> read;
+
+        write_lines("iotest.tmp.txt", lines);
+        read_lines("iotest.tmp.txt", read);
+        BOOST_CHECK( lines == read );
+
+        write_lines("iotest.tmp.txt.gz", lines);
+        read_lines("iotest.tmp.txt.gz", read);
+        BOOST_CHECK( lines == read );
+
+        remove("iotest.tmp.txt");
+        remove("iotest.tmp.txt.gz");
+        }
+
+// Missing final line feed and carriage returns
+BOOST_AUTO_TEST_CASE(ReadLineEnds)
+        {
+                cerr << endl;
+        vector<string> lines;
+        lines.push_back("windows line\r");
+        lines.push_back("no line feed");
+        vector<string> read;
+
+        write_lines("iotest.tmp.txt", lines, false);
+        read_lines("iotest.tmp.txt", read);
+        BOOST_REQUIRE_EQUAL( 2, (int)read.size() );
+        BOOST_CHECK_EQUAL( "windows line", read[0] );
+        BOOST_CHECK_EQUAL( "no line feed", read[1] );
+
+        write_lines("iotest.tmp.txt.gz", lines, false);
+        read_lines("iotest.tmp.txt.gz", read);
+        BOOST_REQUIRE_EQUAL( 2, (int)read.size() );
+        BOOST_CHECK_EQUAL( "windows line", read[0] );
+        BOOST_CHECK_EQUAL( "no line feed", read[1] );
+
+        remove("iotest.tmp.txt");
+        remove("iotest.tmp.txt.gz");
+        }
+
+// Line views from an empty file
+BOOST_AUTO_TEST_CASE(ReadEmptyFile)
+        {
+                cerr << endl;
+        write_lines("iotest.tmp.txt", vector<string>());
+        SimpleFileInput inf("iotest.tmp.txt");
+        string_view line;
+        BOOST_CHECK( !inf.getline(line) );
+        remove("iotest.tmp.txt");
+        }
+
+// Number formatting follows printf %g for plain and %f for gzip files
+BOOST_AUTO_TEST_CASE(WriteNumbers)
+        {
+                cerr << endl;
+        vector<string> read;
+        {
+            SimpleFileOutput outf("iotest.tmp.txt");
+            outf << 12 << " " << -7L << " " << 3U << " " << 0.5 << " " << 1e-5 << " " << (float)-2.25 << "\n";
+        }
+        read_lines("iotest.tmp.txt", read);
+        BOOST_REQUIRE_EQUAL( 1, (int)read.size() );
+        BOOST_CHECK_EQUAL( "12 -7 3 0.5 1e-05 -2.25", read[0] );
+
+        {
+            SimpleFileOutput outf("iotest.tmp.txt.gz", 1, 2);
+            outf << 12 << " " << -7L << " " << 3U << " " << 0.5 << " " << 1e-5 << " " << (float)-2.25 << "\n";
+        }
+        read_lines("iotest.tmp.txt.gz", read);
+        BOOST_REQUIRE_EQUAL( 1, (int)read.size() );
+        BOOST_CHECK_EQUAL( "12 -7 3 0.500000 0.000010 -2.250000", read[0] );
+
+        remove("iotest.tmp.txt");
+        remove("iotest.tmp.txt.gz");
+        }
+
+BOOST_AUTO_TEST_CASE(WriteString)
+        {
+                cerr << endl;
+        string output;
+        SimpleFileOutput outf(output, true);
+        outf << 12 << " " << 0.5 << "\n";
+        BOOST_CHECK_EQUAL( "", output );
+        outf.flush();
+        BOOST_CHECK_EQUAL( "12 0.500000\n", output );
+        output.clear();
+        outf << "next";
+        outf.close();
+        BOOST_CHECK_EQUAL( "next", output );
+        }
@@ -0,0 +1,329 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+
+#include "Ngram.hh"
+
+using namespace std;
+
+void
+assert_same_scores(const Ngram& ngram1,
+        const Ngram& ngram2)
+{
+    BOOST_REQUIRE( ngram1.vocabulary == ngram2.vocabulary );
+    BOOST_REQUIRE_EQUAL( ngram1.nodes.size(), ngram2.nodes.size() );
+    BOOST_CHECK_EQUAL( ngram1.max_order, ngram2.max_order );
+    BOOST_CHECK_EQUAL( ngram1.sentence_start_node, ngram2.sentence_start_node );
+    BOOST_CHECK_EQUAL( ngram1.unk_symbol_idx, ngram2.unk_symbol_idx );
+    for (int node = 0; node<(int)ngram1.nodes.size(); node += 97) {
+        for (int word = 0; word<(int)ngram1.vocabulary.size(); word += 13) {
+            double score1 = 0.0, score2 = 0.0;
+            int next1 = ngram1.score(node, word, score1);
+            int next2 = ngram2.score(node, word, score2);
+            BOOST_CHECK_EQUAL( next1, next2 );
+            BOOST_CHECK_CLOSE( score1, score2, 0.0001 );
+        }
+    }
+}
+
+// Binary model gives the same scores as the ARPA model
+BOOST_AUTO_TEST_CASE(BinaryModel)
+        {
+                cerr << endl;
+        LNNgram arpa_ngram;
+        arpa_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        arpa_ngram.write_binary("ngramtest.tmp.bin");
+        BOOST_CHECK( Ngram::is_binary_model("ngramtest.tmp.bin") );
+        BOOST_CHECK( !Ngram::is_binary_model("data/classes.2g.wb.arpa.gz") );
+
+        LNNgram bin_ngram;
+        bin_ngram.read_model("ngramtest.tmp.bin");
+        BOOST_CHECK( !bin_ngram.nodes.owned() );
+        assert_same_scores(arpa_ngram, bin_ngram);
+
+        // Log base is converted when reading
+        Ngram log10_arpa_ngram;
+        log10_arpa_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        Ngram log10_bin_ngram;
+        log10_bin_ngram.read_model("ngramtest.tmp.bin");
+        assert_same_scores(log10_arpa_ngram, log10_bin_ngram);
+
+        remove("ngramtest.tmp.bin");
+        }
+
+// Copy of a binary model with one header field replaced
+void
+write_modified_header(string binfname, string outfname, size_t offset, int64_t value, size_t len)
+{
+    ifstream binf(binfname, ios_base::in | ios_base::binary);
+    string data((istreambuf_iterator<char>(binf)), istreambuf_iterator<char>());
+    memcpy(&data[offset], &value, len);
+    ofstream outf(outfname, ios_base::out | ios_base::binary);
+    outf.write(data.data(), data.size());
+}
+
+// Header fields out of range are rejected before the sections are read
+BOOST_AUTO_TEST_CASE(BinaryModelHeaderErrors)
+        {
+                cerr << endl;
+        LNNgram arpa_ngram;
+        arpa_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        arpa_ngram.write_binary("ngramtest.tmp.bin");
+
+        // Offsets of max_order, root_node, sentence_start_node, unk_symbol_idx,
+        // layout, num_nodes, num_arcs and vocabulary_bytes in the header
+        vector<vector<int64_t>> fields = {
+            { 20, -1, 4 }, { 20, 1LL << 30, 4 },
+            { 24, -1, 4 }, { 24, arpa_ngram.num_nodes(), 4 },
+            { 28, arpa_ngram.num_nodes(), 4 }, { 40, (int64_t) arpa_ngram.vocabulary.size(), 4 },
+            { 44, 3, 4 },
+            { 48, -1, 8 }, { 48, 1LL << 61, 8 },
+            { 56, -1, 8 }, { 56, 1LL << 61, 8 },
+            { 72, -1, 8 } };
+        for (auto fit = fields.begin(); fit!=fields.end(); ++fit) {
+            write_modified_header("ngramtest.tmp.bin", "ngramtest.tmp2.bin", (*fit)[0], (*fit)[1], (*fit)[2]);
+            LNNgram bin_ngram;
+            BOOST_CHECK_THROW( bin_ngram.read_binary("ngramtest.tmp2.bin"), string );
+        }
+
+        // The unmodified copy is read
+        write_modified_header("ngramtest.tmp.bin", "ngramtest.tmp2.bin", 20, arpa_ngram.max_order, 4);
+        LNNgram bin_ngram;
+        bin_ngram.read_binary("ngramtest.tmp2.bin");
+        assert_same_scores(arpa_ngram, bin_ngram);
+
+        remove("ngramtest.tmp.bin");
+        remove("ngramtest.tmp2.bin");
+        }
+
+// Parallel ARPA reading builds the same model as a single thread
+BOOST_AUTO_TEST_CASE(ParallelArpaRead)
+        {
+                cerr << endl;
+        LNNgram ngram1;
+        ngram1.num_read_threads = 1;
+        ngram1.read_arpa("data/classes.2g.wb.arpa.gz");
+        LNNgram ngram4;
+        ngram4.num_read_threads = 4;
+        ngram4.read_arpa("data/classes.2g.wb.arpa.gz");
+        assert_same_scores(ngram1, ngram4);
+        for (int i = 0; i<(int)ngram1.nodes.size(); i++) {
+            BOOST_REQUIRE_EQUAL( ngram1.nodes[i].first_arc, ngram4.nodes[i].first_arc );
+            BOOST_REQUIRE_EQUAL( ngram1.nodes[i].last_arc, ngram4.nodes[i].last_arc );
+            BOOST_REQUIRE_EQUAL( ngram1.nodes[i].backoff_node, ngram4.nodes[i].backoff_node );
+        }
+        }
+
+void
+assert_close_scores(const Ngram& ngram1,
+        const Ngram& ngram2,
+        double max_diff)
+{
+    BOOST_REQUIRE_EQUAL( ngram1.num_nodes(), ngram2.num_nodes() );
+    for (int node = 0; node<ngram1.num_nodes(); node += 97) {
+        int first_arc1, last_arc1, first_arc2, last_arc2;
+        ngram1.node_arcs(node, first_arc1, last_arc1);
+        ngram2.node_arcs(node, first_arc2, last_arc2);
+        BOOST_CHECK_EQUAL( first_arc1, first_arc2 );
+        BOOST_CHECK_EQUAL( last_arc1, last_arc2 );
+        for (int word = 0; word<(int)ngram1.vocabulary.size(); word += 13) {
+            double score1 = 0.0, score2 = 0.0;
+            int next1 = ngram1.score(node, word, score1);
+            int next2 = ngram2.score(node, word, score2);
+            BOOST_CHECK_EQUAL( next1, next2 );
+            BOOST_CHECK_SMALL( score1-score2, max_diff );
+        }
+    }
+}
+
+// Compact layouts keep the structure and approximate the probabilities
+BOOST_AUTO_TEST_CASE(CompactModel)
+        {
+                cerr << endl;
+        LNNgram ngram;
+        ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+
+        LNNgram float_ngram;
+        float_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        float_ngram.compact(32);
+        assert_close_scores(ngram, float_ngram, 0.0001);
+
+        LNNgram quantized_ngram;
+        quantized_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        quantized_ngram.compact(16);
+        assert_close_scores(ngram, quantized_ngram, 0.001);
+
+        quantized_ngram.write_binary("ngramtest.tmp.bin");
+        LNNgram bin_ngram;
+        bin_ngram.read_model("ngramtest.tmp.bin");
+        BOOST_CHECK_EQUAL( Ngram::QUANTIZED_NODES, bin_ngram.layout );
+        assert_close_scores(quantized_ngram, bin_ngram, 0.00001);
+        remove("ngramtest.tmp.bin");
+
+        LNNgram byte_ngram;
+        byte_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        BOOST_CHECK_THROW( byte_ngram.compact(8), string );
+        }
+
+// Root index and arc hash tables give the same nodes as the binary search
+BOOST_AUTO_TEST_CASE(LookupTables)
+        {
+                cerr << endl;
+        LNNgram ngram;
+        ngram.hash_fanout_threshold = 16;
+        ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        BOOST_CHECK( ngram.root_arc_targets.size() == ngram.vocabulary.size() );
+        BOOST_CHECK( ngram.arc_hash_tables.size() > 0 );
+        BOOST_CHECK_EQUAL( (int)ngram.node_arc_hash_tables.size(), ngram.num_nodes() );
+
+        LNNgram search_ngram;
+        search_ngram.hash_fanout_threshold = 0;
+        search_ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        search_ngram.root_arc_targets.clear();
+        BOOST_CHECK( search_ngram.arc_hash_tables.size() == 0 );
+
+        for (int node = 0; node<ngram.num_nodes(); node += 311)
+            for (int word = 0; word<(int)ngram.vocabulary.size(); word += 7)
+                BOOST_REQUIRE_EQUAL( search_ngram.find_node(node, word), ngram.find_node(node, word) );
+        assert_same_scores(ngram, search_ngram);
+        }
+
+BOOST_AUTO_TEST_CASE(BatchScoring)
+        {
+                cerr << endl;
+        LNNgram ngram;
+        ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+
+        vector<int> words;
+        for (int word = (int)ngram.vocabulary.size()-1; word>=0; word -= 3)
+            words.push_back(word);
+        vector<double> scores;
+        vector<int> next_nodes;
+        for (int node = 0; node<ngram.num_nodes(); node += 311) {
+            ngram.score(node, words, scores, next_nodes);
+            BOOST_REQUIRE_EQUAL( scores.size(), words.size() );
+            for (unsigned int i = 0; i<words.size(); i++) {
+                double score = 0.0;
+                int next_node = ngram.score(node, words[i], score);
+                BOOST_REQUIRE_EQUAL( next_nodes[i], next_node );
+                BOOST_REQUIRE_CLOSE( scores[i], score, 0.0001 );
+            }
+        }
+
+        vector<int> nodes;
+        for (int node = ngram.num_nodes()-1; node>=0; node -= 97)
+            nodes.push_back(node);
+        nodes.push_back(nodes[0]);
+        for (int word = 0; word<(int)ngram.vocabulary.size(); word += 13) {
+            ngram.score(nodes, word, scores, next_nodes);
+            BOOST_REQUIRE_EQUAL( scores.size(), nodes.size() );
+            for (unsigned int i = 0; i<nodes.size(); i++) {
+                double score = 0.0;
+                int next_node = ngram.score(nodes[i], word, score);
+                BOOST_REQUIRE_EQUAL( next_nodes[i], next_node );
+                BOOST_REQUIRE_CLOSE( scores[i], score, 0.0001 );
+            }
+        }
+        }
+
+BOOST_AUTO_TEST_CASE(ScoreCaching)
+        {
+                cerr << endl;
+        LNNgram ngram;
+        ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        // Small cache so that the slots are overwritten often
+        ScoreCache cache(ngram, 6);
+
+        vector<int> words;
+        for (int word = 0; word<(int)ngram.vocabulary.size(); word += 5)
+            words.push_back(word);
+
+        auto check_scores = [&](int thread_idx) {
+            vector<double> scores;
+            vector<int> next_nodes;
+            for (int round = 0; round<2; round++)
+                for (int node = thread_idx; node<ngram.num_nodes(); node += 1009) {
+                    cache.score(node, words, scores, next_nodes);
+                    for (unsigned int i = 0; i<words.size(); i++) {
+                        double score = 0.0;
+                        int next_node = ngram.score(node, words[i], score);
+                        double cache_score = 0.0;
+                        int cache_next_node = cache.score(node, words[i], cache_score);
+                        if (next_nodes[i]!=next_node || cache_next_node!=next_node
+                                || scores[i]!=score || cache_score!=score)
+                            throw string("Cached score mismatch");
+                    }
+                }
+        };
+
+        check_scores(0);
+        double score = 0.0;
+        cache.score(ngram.root_node, words[1], score);
+        cache.score(ngram.root_node, words[1], score);
+        BOOST_CHECK( cache.hits() > 0 );
+        BOOST_CHECK( cache.misses() > 0 );
+        unsigned long int single_thread_lookups = cache.hits()+cache.misses();
+
+        vector<int> failures(4, 0);
+        vector<std::thread> workers;
+        for (int t = 0; t<4; t++)
+            workers.push_back(std::thread([&, t]() {
+                try { check_scores(t); }
+                catch (string& e) { failures[t] = 1; }
+            }));
+        for (int t = 0; t<4; t++) {
+            workers[t].join();
+            BOOST_CHECK_EQUAL( failures[t], 0 );
+        }
+        // Lookups of all threads are counted
+        BOOST_CHECK( cache.hits()+cache.misses() > 3*single_thread_lookups );
+        }
+
+BOOST_AUTO_TEST_CASE(AdvanceWithoutProbs)
+        {
+                cerr << endl;
+        for (int bits: {0, 32, 16}) {
+            LNNgram ngram;
+            ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+            if (bits>0) ngram.compact(bits);
+            for (int node = 0; node<ngram.num_nodes(); node += 313)
+                for (int word = 0; word<(int)ngram.vocabulary.size(); word += 11) {
+                    float score = 0.0;
+                    BOOST_REQUIRE_EQUAL( ngram.advance(node, word), ngram.score(node, word, score) );
+                }
+
+            vector<int> words;
+            for (int word = (int)ngram.vocabulary.size()-1; word>=0; word -= 7)
+                words.push_back(word);
+            vector<int> next_nodes;
+            for (int node = 0; node<ngram.num_nodes(); node += 317) {
+                ngram.advance(node, words, next_nodes);
+                BOOST_REQUIRE_EQUAL( next_nodes.size(), words.size() );
+                for (unsigned int i = 0; i<words.size(); i++)
+                    BOOST_REQUIRE_EQUAL( next_nodes[i], ngram.advance(node, words[i]) );
+            }
+        }
+        }
+
+BOOST_AUTO_TEST_CASE(WriteArpa)
+        {
+                cerr << endl;
+        LNNgram ngram;
+        ngram.read_arpa("data/classes.2g.wb.arpa.gz");
+        LNNgram orig_ngram(ngram);
+        ngram.write_arpa("ngramtest.tmp.arpa");
+        // Writing converts the probabilities without modifying the model
+        assert_same_scores(ngram, orig_ngram);
+
+        LNNgram written_ngram;
+        written_ngram.read_arpa("ngramtest.tmp.arpa");
+        BOOST_CHECK_EQUAL( ngram.num_nodes(), written_ngram.num_nodes() );
+        assert_close_scores(ngram, written_ngram, 0.0001);
+        remove("ngramtest.tmp.arpa");
+        }
@@ -1,11 +1,29 @@
 #include "io.hh"
 
+#include <charconv>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define GZIP_BUFFER_SIZE 1048576
+#define GZIP_BUFFER_SIZE 4194304
+#define GZIP_NUM_BUFFERS 3
+#define OUTPUT_BUFFER_SIZE 262144
+#define MAX_NUMBER_LENGTH 400
+
+static const size_t GZIP_BLOCK_SIZE = 1048576;
 
 using namespace std;
 
+// Strip the line feed and a possible carriage return
+inline void
+terminate_line(const char* start, size_t len, string_view& line)
+{
+    if (len>0 && start[len-1]=='\r') len--;
+    line = string_view(start, len);
+}
+
 SimpleFileInput::SimpleFileInput(string filename)
 {
     if (ends_with(filename, ".gz")) {
@@ -16,8 +34,16 @@ SimpleFileInput::SimpleFileInput(string filename)
         exit(1);
 #endif
     }
-    else
-        infs = new IFStreamInput(filename);
+    else {
+        MMapFile* mmapf = new MMapFile(filename);
+        if (mmapf->is_open())
+            infs = new MMapFileInput(mmapf);
+        else {
+            // Pipes and other special files
+            delete mmapf;
+            infs = new IFStreamInput(filename);
+        }
+    }
 }
 
 SimpleFileInput::~SimpleFileInput()
@@ -25,36 +51,189 @@ SimpleFileInput::~SimpleFileInput()
     if (infs) delete infs;
 }
 
+MMapFile::MMapFile(string filename, bool private_mapping)
+        :m_fd(-1), m_data(nullptr), m_size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd==-1) return;
+    struct stat st;
+    if (fstat(fd, &st)==-1 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return;
+    }
+    m_size = st.st_size;
+    if (m_size>0) {
+        void* addr = private_mapping
+                     ? mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                     : mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr==MAP_FAILED) {
+            ::close(fd);
+            m_size = 0;
+            return;
+        }
+        m_data = static_cast<char*>(addr);
+        if (!private_mapping) madvise(addr, m_size, MADV_SEQUENTIAL);
+    }
+    m_fd = fd;
+}
+
+MMapFile::~MMapFile()
+{
+    if (m_data!=nullptr) munmap(m_data, m_size);
+    if (m_fd!=-1) ::close(m_fd);
+}
+
+bool
+IFStreamInput::getline(string_view& line)
+{
+    if (!std::getline(ifstr, m_line)) return false;
+    terminate_line(m_line.data(), m_line.size(), line);
+    return true;
+}
+
+bool
+MMapFileInput::getline(string_view& line)
+{
+    size_t size = m_file->size();
+    if (m_pos>=size) return false;
+    const char* start = m_file->data()+m_pos;
+    const char* end = static_cast<const char*>(memchr(start, '\n', size-m_pos));
+    if (end==nullptr) {
+        terminate_line(start, size-m_pos, line);
+        m_pos = size;
+    }
+    else {
+        terminate_line(start, end-start, line);
+        m_pos += end-start+1;
+    }
+    return true;
+}
+
 #ifndef NO_ZLIB
 GZipFileInput::GZipFileInput(string filename)
+        :m_eof(false), m_stop(false), m_curr_block(nullptr), m_pos(0)
 {
     gzf = gzopen(filename.c_str(), "r");
+    if (gzf!=NULL) gzbuffer(gzf, 262144);
+    for (int i = 0; i<GZIP_NUM_BUFFERS; i++)
+        m_free_blocks.push_back(new string());
+    m_decompressor = std::thread(&GZipFileInput::decompress, this);
 }
 
 GZipFileInput::~GZipFileInput()
 {
-    gzclose(gzf);
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_decompressor.join();
+    if (gzf!=NULL) gzclose(gzf);
+    if (m_curr_block!=nullptr) delete m_curr_block;
+    for (auto bit = m_full_blocks.begin(); bit!=m_full_blocks.end(); ++bit)
+        delete *bit;
+    for (auto bit = m_free_blocks.begin(); bit!=m_free_blocks.end(); ++bit)
+        delete *bit;
+}
+
+void
+GZipFileInput::decompress()
+{
+    while (true) {
+        string* block;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || m_free_blocks.size()>0; });
+            if (m_stop) return;
+            block = m_free_blocks.back();
+            m_free_blocks.pop_back();
+        }
+
+        int len = 0;
+        if (gzf!=NULL) {
+            block->resize(GZIP_BUFFER_SIZE);
+            len = gzread(gzf, &(*block)[0], GZIP_BUFFER_SIZE);
+        }
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (len<=0) {
+                m_free_blocks.push_back(block);
+                m_eof = true;
+            }
+            else {
+                block->resize(len);
+                m_full_blocks.push_back(block);
+            }
+        }
+        m_cond.notify_all();
+        if (len<=0) return;
+    }
 }
 
 bool
-GZipFileInput::getline(string& line)
+GZipFileInput::next_block()
 {
-    char buffer[GZIP_BUFFER_SIZE];
-    char* res = gzgets(gzf, buffer, GZIP_BUFFER_SIZE-1);
-    if (res!=NULL) {
-        strtok(buffer, "\r\n");
-        line.assign(buffer);
+    unique_lock<mutex> lock(m_mutex);
+    if (m_curr_block!=nullptr) {
+        m_free_blocks.push_back(m_curr_block);
+        m_curr_block = nullptr;
+        m_cond.notify_all();
+    }
+    m_cond.wait(lock, [this] { return m_eof || m_full_blocks.size()>0; });
+    if (m_full_blocks.size()==0) return false;
+    m_curr_block = m_full_blocks.front();
+    m_full_blocks.pop_front();
+    m_pos = 0;
+    return true;
+}
+
+bool
+GZipFileInput::getline(string_view& line)
+{
+    m_partial_line.clear();
+    bool partial = false;
+    while (true) {
+        if (m_curr_block==nullptr || m_pos>=m_curr_block->size()) {
+            if (!next_block()) {
+                if (!partial) return false;
+                terminate_line(m_partial_line.data(), m_partial_line.size(), line);
+                return true;
+            }
+        }
+
+        const char* start = m_curr_block->data()+m_pos;
+        size_t avail = m_curr_block->size()-m_pos;
+        const char* end = static_cast<const char*>(memchr(start, '\n', avail));
+        if (end==nullptr) {
+            // Line continues in the next block
+            m_partial_line.append(start, avail);
+            m_pos += avail;
+            partial = true;
+            continue;
+        }
+
+        m_pos += end-start+1;
+        if (partial) {
+            m_partial_line.append(start, end-start);
+            terminate_line(m_partial_line.data(), m_partial_line.size(), line);
+        }
+        else
+            terminate_line(start, end-start, line);
         return true;
     }
-    return false;
 }
 #endif
 
-SimpleFileOutput::SimpleFileOutput(string filename)
+SimpleFileOutput::SimpleFileOutput(string filename,
+        int compression_level,
+        unsigned int num_threads)
+        :m_fixed_floats(false), m_buffer(OUTPUT_BUFFER_SIZE), m_buffer_pos(0)
 {
     if (ends_with(filename, ".gz")) {
 #ifndef NO_ZLIB
-        outfs = new GZipFileOutput(filename);
+        outfs = new GZipFileOutput(filename, compression_level, num_threads);
+        m_fixed_floats = true;
 #else
         cerr << "No ZLIB support" << endl;
         exit(1);
@@ -64,6 +243,13 @@ SimpleFileOutput::SimpleFileOutput(string filename)
         outfs = new OFStream(filename);
 }
 
+SimpleFileOutput::SimpleFileOutput(string& output,
+        bool fixed_floats)
+        :m_fixed_floats(fixed_floats), m_buffer(OUTPUT_BUFFER_SIZE), m_buffer_pos(0)
+{
+    outfs = new StringOutput(output);
+}
+
 SimpleFileOutput::~SimpleFileOutput()
 {
     close();
@@ -73,58 +259,110 @@ void
 SimpleFileOutput::close()
 {
     if (outfs) {
+        flush();
         outfs->close();
         delete outfs;
         outfs = NULL;
     }
 }
 
+void
+SimpleFileOutput::flush()
+{
+    if (m_buffer_pos>0) outfs->write(m_buffer.data(), m_buffer_pos);
+    m_buffer_pos = 0;
+}
+
+void
+SimpleFileOutput::write(const char* data, size_t len)
+{
+    if (m_buffer_pos+len>m_buffer.size()) {
+        flush();
+        if (len>m_buffer.size()) {
+            outfs->write(data, len);
+            return;
+        }
+    }
+    memcpy(m_buffer.data()+m_buffer_pos, data, len);
+    m_buffer_pos += len;
+}
+
+template<typename T>
+void
+SimpleFileOutput::format_integer(T value)
+{
+    if (m_buffer_pos+MAX_NUMBER_LENGTH>m_buffer.size()) flush();
+    char* start = m_buffer.data()+m_buffer_pos;
+    to_chars_result res = to_chars(start, m_buffer.data()+m_buffer.size(), value);
+    m_buffer_pos += res.ptr-start;
+}
+
+template<typename T>
+void
+SimpleFileOutput::format_float(T value)
+{
+    if (m_buffer_pos+MAX_NUMBER_LENGTH>m_buffer.size()) flush();
+    char* start = m_buffer.data()+m_buffer_pos;
+    char* end = m_buffer.data()+m_buffer.size();
+    to_chars_result res = m_fixed_floats
+                          ? to_chars(start, end, value, chars_format::fixed, 6)
+                          : to_chars(start, end, value, chars_format::general, 6);
+    m_buffer_pos += res.ptr-start;
+}
+
 SimpleFileOutput&
 SimpleFileOutput::operator<<(const std::string& str)
 {
-    *outfs << str;
+    write(str.data(), str.size());
+    return *this;
+}
+
+SimpleFileOutput&
+SimpleFileOutput::operator<<(const char* str)
+{
+    write(str, strlen(str));
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(int intr)
 {
-    *outfs << intr;
+    format_integer(intr);
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(long int lintr)
 {
-    *outfs << lintr;
+    format_integer(lintr);
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(unsigned int uintr)
 {
-    *outfs << uintr;
+    format_integer(uintr);
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(long unsigned int luintr)
 {
-    *outfs << luintr;
+    format_integer(luintr);
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(float fltn)
 {
-    *outfs << fltn;
+    format_float(fltn);
     return *this;
 }
 
 SimpleFileOutput&
 SimpleFileOutput::operator<<(double dfltn)
 {
-    *outfs << dfltn;
+    format_float(dfltn);
     return *this;
 }
 
@@ -144,60 +382,30 @@ OFStream::close()
     ofstr.close();
 }
 
-OFStream&
-OFStream::operator<<(const std::string& str)
-{
-    ofstr << str;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(int intr)
-{
-    ofstr << intr;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(long int lintr)
-{
-    ofstr << lintr;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(unsigned int uintr)
-{
-    ofstr << uintr;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(long unsigned int luintr)
-{
-    ofstr << luintr;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(float fltn)
-{
-    ofstr << fltn;
-    return *this;
-}
-
-OFStream&
-OFStream::operator<<(double dfltn)
+void
+OFStream::write(const char* data, size_t len)
 {
-    ofstr << dfltn;
-    return *this;
+    ofstr.write(data, len);
 }
 
 #ifndef NO_ZLIB
-GZipFileOutput::GZipFileOutput(string filename)
-{
-    gzf = gzopen(filename.c_str(), "w");
-    file_open = true;
+GZipFileOutput::GZipFileOutput(string filename,
+        int compression_level,
+        unsigned int num_threads)
+        :m_compression_level(compression_level),
+         m_max_blocks(2*max(1U, num_threads)+1),
+         m_blocks_written(false),
+         m_stop(false),
+         m_curr_block(new Block())
+{
+    m_file = fopen(filename.c_str(), "wb");
+    if (m_file==NULL) {
+        cerr << "Could not open file for writing: " << filename << endl;
+        exit(1);
+    }
+    for (unsigned int i = 0; i<max(1U, num_threads); i++)
+        m_compressors.push_back(std::thread(&GZipFileOutput::compress_blocks, this));
+    m_writer = std::thread(&GZipFileOutput::write_blocks, this);
 }
 
 GZipFileOutput::~GZipFileOutput()
@@ -208,60 +416,119 @@ GZipFileOutput::~GZipFileOutput()
 void
 GZipFileOutput::close()
 {
-    if (file_open) {
-        gzclose(gzf);
-        gzf = NULL;
-    }
-    file_open = false;
-}
+    if (m_file==NULL) return;
 
-GZipFileOutput&
-GZipFileOutput::operator<<(const std::string& str)
-{
-    gzprintf(gzf, "%s", str.c_str());
-    return *this;
-}
+    // An empty member keeps empty files valid
+    if (m_curr_block->input.size()>0 || !m_blocks_written) submit_block();
+    delete m_curr_block;
+    m_curr_block = nullptr;
 
-GZipFileOutput&
-GZipFileOutput::operator<<(int intr)
-{
-    gzprintf(gzf, "%d", intr);
-    return *this;
-}
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto cit = m_compressors.begin(); cit!=m_compressors.end(); ++cit)
+        cit->join();
+    m_writer.join();
 
-GZipFileOutput&
-GZipFileOutput::operator<<(long int lintr)
-{
-    gzprintf(gzf, "%ld", lintr);
-    return *this;
+    fclose(m_file);
+    m_file = NULL;
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(unsigned int uintr)
-{
-    gzprintf(gzf, "%u", uintr);
-    return *this;
+void
+GZipFileOutput::write(const char* data, size_t len)
+{
+    while (len>0) {
+        size_t curr_len = min(len, GZIP_BLOCK_SIZE-m_curr_block->input.size());
+        m_curr_block->input.append(data, curr_len);
+        data += curr_len;
+        len -= curr_len;
+        if (m_curr_block->input.size()>=GZIP_BLOCK_SIZE) submit_block();
+    }
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(long unsigned int luintr)
+void
+GZipFileOutput::submit_block()
 {
-    gzprintf(gzf, "%lu", luintr);
-    return *this;
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_blocks.size()<m_max_blocks; });
+        m_blocks.push_back(m_curr_block);
+        m_todo_blocks.push_back(m_curr_block);
+    }
+    m_cond.notify_all();
+    m_blocks_written = true;
+    m_curr_block = new Block();
+    m_curr_block->input.reserve(GZIP_BLOCK_SIZE);
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(float fltn)
-{
-    gzprintf(gzf, "%f", fltn);
-    return *this;
+void
+GZipFileOutput::compress_blocks()
+{
+    while (true) {
+        Block* block;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || m_todo_blocks.size()>0; });
+            if (m_todo_blocks.size()==0) return;
+            block = m_todo_blocks.front();
+            m_todo_blocks.pop_front();
+        }
+
+        z_stream strm;
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        // Window bits 15+16 for a gzip header and trailer
+        if (deflateInit2(&strm, m_compression_level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)!=Z_OK) {
+            cerr << "Problem initializing gzip compression" << endl;
+            exit(1);
+        }
+        block->output.resize(deflateBound(&strm, block->input.size()));
+        strm.next_in = reinterpret_cast<Bytef*>(&block->input[0]);
+        strm.avail_in = block->input.size();
+        strm.next_out = reinterpret_cast<Bytef*>(&block->output[0]);
+        strm.avail_out = block->output.size();
+        if (deflate(&strm, Z_FINISH)!=Z_STREAM_END) {
+            cerr << "Problem in gzip compression" << endl;
+            exit(1);
+        }
+        block->output.resize(strm.total_out);
+        deflateEnd(&strm);
+        string().swap(block->input);
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            block->done = true;
+        }
+        m_cond.notify_all();
+    }
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(double dfltn)
-{
-    gzprintf(gzf, "%f", dfltn);
-    return *this;
+void
+GZipFileOutput::write_blocks()
+{
+    while (true) {
+        Block* block;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] {
+                return (m_blocks.size()>0 && m_blocks.front()->done)
+                        || (m_stop && m_blocks.size()==0);
+            });
+            if (m_blocks.size()==0) return;
+            block = m_blocks.front();
+        }
+
+        fwrite(block->output.data(), 1, block->output.size(), m_file);
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_blocks.pop_front();
+        }
+        m_cond.notify_all();
+        delete block;
+    }
 }
 #endif
-
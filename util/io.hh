@@ -2,17 +2,39 @@
 #define SIMPLE_IO
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
 
 #ifndef NO_ZLIB
 #include "zlib.h"
 #endif
 
+// Memory mapping of a whole file, a private mapping is writable
+// with copy-on-write semantics and does not modify the file
+class MMapFile {
+public:
+    MMapFile(std::string filename, bool private_mapping = false);
+    ~MMapFile();
+    bool is_open() const { return m_fd!=-1; }
+    char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+private:
+    int m_fd;
+    char* m_data;
+    size_t m_size;
+};
+
+// The line views returned by getline are valid until the next call
 class FileInputType {
 public:
-    virtual bool getline(std::string& line) = 0;
+    virtual bool getline(std::string_view& line) = 0;
     virtual ~FileInputType() { };
 };
 
@@ -20,19 +42,43 @@ class IFStreamInput : public FileInputType {
 public:
     IFStreamInput(std::string filename) { ifstr.open(filename.c_str(), std::ios_base::in); };
     ~IFStreamInput() { ifstr.close(); }
-    bool getline(std::string& line) { return (bool) std::getline(ifstr, line); }
+    bool getline(std::string_view& line);
 private:
     std::ifstream ifstr;
+    std::string m_line;
+};
+
+class MMapFileInput : public FileInputType {
+public:
+    MMapFileInput(MMapFile* mmapf) :m_file(mmapf), m_pos(0) { };
+    ~MMapFileInput() { delete m_file; }
+    bool getline(std::string_view& line);
+private:
+    MMapFile* m_file;
+    size_t m_pos;
 };
 
 #ifndef NO_ZLIB
+// Decompresses fixed size blocks in a background thread
 class GZipFileInput : public FileInputType {
 public:
     GZipFileInput(std::string filename);
     ~GZipFileInput();
-    bool getline(std::string& line);
+    bool getline(std::string_view& line);
 private:
+    void decompress();
+    bool next_block();
     gzFile gzf;
+    std::thread m_decompressor;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::string*> m_full_blocks;
+    std::vector<std::string*> m_free_blocks;
+    bool m_eof;
+    bool m_stop;
+    std::string* m_curr_block;
+    size_t m_pos;
+    std::string m_partial_line;
 };
 #endif
 
@@ -40,7 +86,14 @@ class SimpleFileInput {
 public:
     SimpleFileInput(std::string filename);
     ~SimpleFileInput();
-    bool getline(std::string& line) { return infs->getline(line); }
+    bool getline(std::string& line)
+    {
+        std::string_view view;
+        if (!infs->getline(view)) return false;
+        line.assign(view.data(), view.size());
+        return true;
+    }
+    bool getline(std::string_view& line) { return infs->getline(line); }
 private:
     bool ends_with(std::string const& filename,
             std::string const& suffix)
@@ -54,13 +107,7 @@ private:
 class FileOutputType {
 public:
     virtual void close() = 0;
-    virtual FileOutputType& operator<<(const std::string& str) = 0;
-    virtual FileOutputType& operator<<(int) = 0;
-    virtual FileOutputType& operator<<(long int) = 0;
-    virtual FileOutputType& operator<<(unsigned int) = 0;
-    virtual FileOutputType& operator<<(long unsigned int) = 0;
-    virtual FileOutputType& operator<<(float) = 0;
-    virtual FileOutputType& operator<<(double) = 0;
+    virtual void write(const char* data, size_t len) = 0;
     virtual ~FileOutputType() { };
 };
 
@@ -69,42 +116,75 @@ public:
     OFStream(std::string filename);
     ~OFStream();
     void close();
-    OFStream& operator<<(const std::string& str);
-    OFStream& operator<<(int);
-    OFStream& operator<<(long int);
-    OFStream& operator<<(unsigned int);
-    OFStream& operator<<(long unsigned int);
-    OFStream& operator<<(float);
-    OFStream& operator<<(double);
+    void write(const char* data, size_t len);
 private:
     std::ofstream ofstr;
 };
 
+// Appends to a string for formatting output in memory
+class StringOutput : public FileOutputType {
+public:
+    StringOutput(std::string& output) :m_output(output) { };
+    void close() { };
+    void write(const char* data, size_t len) { m_output.append(data, len); }
+private:
+    std::string& m_output;
+};
+
 #ifndef NO_ZLIB
+// Compresses independent blocks in worker threads, the result
+// is a multi-member gzip file
 class GZipFileOutput : public FileOutputType {
 public:
-    GZipFileOutput(std::string filename);
+    GZipFileOutput(std::string filename,
+            int compression_level = 6,
+            unsigned int num_threads = 1);
     ~GZipFileOutput();
     void close();
-    GZipFileOutput& operator<<(const std::string& str);
-    GZipFileOutput& operator<<(int);
-    GZipFileOutput& operator<<(long int);
-    GZipFileOutput& operator<<(unsigned int);
-    GZipFileOutput& operator<<(long unsigned int);
-    GZipFileOutput& operator<<(float);
-    GZipFileOutput& operator<<(double);
+    void write(const char* data, size_t len);
 private:
-    gzFile gzf;
-    bool file_open;
+    class Block {
+    public:
+        Block() :done(false) { };
+        std::string input;
+        std::string output;
+        bool done;
+    };
+    void submit_block();
+    void compress_blocks();
+    void write_blocks();
+    FILE* m_file;
+    int m_compression_level;
+    unsigned int m_max_blocks;
+    bool m_blocks_written;
+    bool m_stop;
+    Block* m_curr_block;
+    std::deque<Block*> m_blocks;
+    std::deque<Block*> m_todo_blocks;
+    std::vector<std::thread> m_compressors;
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
 };
 #endif
 
+// Formats into a local buffer which is passed to the file in large writes.
+// Floating point numbers are written as %g to plain and as %f to gzip files.
+// Gzip files are compressed in one thread unless more are asked for.
 class SimpleFileOutput {
 public:
-    SimpleFileOutput(std::string filename);
+    SimpleFileOutput(std::string filename,
+            int compression_level = 6,
+            unsigned int num_threads = 1);
+    // Formats to the string on flush, fixed floats match the gzip output
+    SimpleFileOutput(std::string& output,
+            bool fixed_floats);
     ~SimpleFileOutput();
     void close();
+    void flush();
+    void write(const char* data, size_t len);
     SimpleFileOutput& operator<<(const std::string& str);
+    SimpleFileOutput& operator<<(const char* str);
     SimpleFileOutput& operator<<(int);
     SimpleFileOutput& operator<<(long int);
     SimpleFileOutput& operator<<(unsigned int);
@@ -118,7 +198,12 @@ private:
         if (filename.length()<suffix.length()) return false;
         return (0==filename.compare(filename.length()-suffix.length(), suffix.length(), suffix));
     }
+    template<typename T> void format_integer(T value);
+    template<typename T> void format_float(T value);
     FileOutputType* outfs;
+    bool m_fixed_floats;
+    std::vector<char> m_buffer;
+    size_t m_buffer_pos;
 };
 
 #endif